@@ -0,0 +1,616 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <glm/glm.hpp>
+#include <glm\gtx\quaternion.hpp>
+
+#include <assimp/scene.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace glm;
+
+// Number of keys the cursor may step from its last position before giving up
+// and binary searching instead (large seeks, loop wrap-around).
+#define CURSOR_MAX_STEPS 4
+#define INVALID_CHANNEL -1
+#define INVALID_CLIP 0xFFFFFFFF
+
+// Index of a clip in SkinnedModelAsset::Clips, fixed once the asset loads.
+typedef unsigned int ClipHandle;
+
+// The three smallest components of a unit quaternion lie in [-1/sqrt(2), 1/sqrt(2)].
+#define SMALLEST_THREE_RANGE 0.70710678f
+#define SMALLEST_THREE_MAX 32767
+
+enum RotationFormat
+{
+	ROTATION_FLOAT,
+	ROTATION_SMALLEST_THREE_48
+};
+
+enum PositionFormat
+{
+	POSITION_FLOAT,
+	POSITION_RANGE_16,
+	POSITION_RANGE_8
+};
+
+inline unsigned int RotationStride(RotationFormat Format)
+{
+	return Format == ROTATION_SMALLEST_THREE_48 ? 6 : 16;
+}
+
+inline unsigned int PositionStride(PositionFormat Format)
+{
+	if(Format == POSITION_RANGE_16)
+		return 6;
+	if(Format == POSITION_RANGE_8)
+		return 3;
+	return 12;
+}
+
+// 48-bit smallest-three: 2 bits for the index of the dropped (largest)
+// component and 15 bits for each of the other three, which are stored with
+// the sign that makes the dropped component positive.
+inline void PackRotation48(const fquat& q, unsigned short* pOut)
+{
+	float c[4] = { q.x, q.y, q.z, q.w };
+	unsigned int Largest = 0;
+	for(unsigned int i = 1; i < 4; i++)
+		if(fabs(c[i]) > fabs(c[Largest]))
+			Largest = i;
+
+	float Sign = c[Largest] < 0.0f ? -1.0f : 1.0f;
+	unsigned long long Bits = Largest;
+	for(unsigned int i = 0; i < 4; i++)
+	{
+		if(i == Largest)
+			continue;
+		float Unit = (c[i] * Sign / SMALLEST_THREE_RANGE + 1.0f) * 0.5f;
+		Unit = Unit < 0.0f ? 0.0f : (Unit > 1.0f ? 1.0f : Unit);
+		Bits = (Bits << 15) | (unsigned long long)(Unit * SMALLEST_THREE_MAX + 0.5f);
+	}
+	pOut[0] = (unsigned short)(Bits >> 32);
+	pOut[1] = (unsigned short)(Bits >> 16);
+	pOut[2] = (unsigned short)Bits;
+}
+
+inline fquat UnpackRotation48(const unsigned short* pIn)
+{
+	unsigned long long Bits = ((unsigned long long)pIn[0] << 32) | ((unsigned long long)pIn[1] << 16) | pIn[2];
+	unsigned int Largest = (unsigned int)(Bits >> 45) & 3;
+
+	float c[4];
+	float Sum = 0.0f;
+	for(int i = 3; i >= 0; i--)
+	{
+		if(i == (int)Largest)
+			continue;
+		c[i] = ((float)(Bits & 0x7FFF) / SMALLEST_THREE_MAX * 2.0f - 1.0f) * SMALLEST_THREE_RANGE;
+		Sum += c[i] * c[i];
+		Bits >>= 15;
+	}
+	c[Largest] = sqrt(Sum < 1.0f ? 1.0f - Sum : 0.0f);
+
+	return fquat(c[3], c[0], c[1], c[2]);
+}
+
+// Decoded keys of one channel. Only used while importing and recompressing;
+// sampling always goes through AnimationClip.
+struct ChannelKeys
+{
+	string NodeName;
+	vector<float> RotationTimes;
+	vector<fquat> Rotations;
+	vector<float> PositionTimes;
+	vector<vec3> Positions;
+	RotationFormat RotationPacking;
+	PositionFormat PositionPacking;
+
+	ChannelKeys()
+	{
+		RotationPacking = ROTATION_FLOAT;
+		PositionPacking = POSITION_FLOAT;
+	}
+};
+
+// Where one channel's streams live inside AnimationClip::Data, in bytes, and
+// how its values are encoded. Range-quantized positions decode as
+// PositionMin + PositionExtent * q / qmax.
+struct ClipChannel
+{
+	string NodeName;
+	unsigned int NumRotationKeys;
+	unsigned int NumPositionKeys;
+	unsigned int RotationTimes;
+	unsigned int RotationValues;
+	unsigned int PositionTimes;
+	unsigned int PositionValues;
+	RotationFormat RotationPacking;
+	PositionFormat PositionPacking;
+	// Single rotation and position key; needs no search or interpolation.
+	bool Constant;
+	vec3 PositionMin;
+	vec3 PositionExtent;
+};
+
+// Approximated slerp between two keys, normalized: nlerp on the shorter arc
+// with Factor remapped by a cubic whose coefficients are fitted to the
+// angle between the keys (Zeux, "Approximating slerp"). Even for keys half
+// a turn apart the result stays within 1e-3 radians of a true slerp, and
+// needs no acos or sin.
+// The kernels in rotation_sampler.h do the same operations in the same
+// order, so every sampler path returns the same bits.
+inline fquat InterpolateRotation(const fquat& Start, const fquat& End, float Factor)
+{
+	float Half = Factor - 0.5f;
+	float Cubic = Factor * Half * (Factor - 1.0f);
+
+	float bx = End.x, by = End.y, bz = End.z, bw = End.w;
+	float d = Start.x * bx + Start.y * by + Start.z * bz + Start.w * bw;
+	if(d < 0.0f)
+	{
+		d = -d;
+		bx = -bx;
+		by = -by;
+		bz = -bz;
+		bw = -bw;
+	}
+
+	float A = 1.0904f + d * (-3.2452f + d * (3.55645f - d * 1.43519f));
+	float B = 0.848013f + d * (-1.06021f + d * 0.215638f);
+	float k = A * (Half * Half) + B;
+	float ot = Factor + Cubic * k;
+	float u = 1.0f - ot;
+
+	float rx = Start.x * u + bx * ot;
+	float ry = Start.y * u + by * ot;
+	float rz = Start.z * u + bz * ot;
+	float rw = Start.w * u + bw * ot;
+	float Length = sqrt(rx * rx + ry * ry + rz * rz + rw * rw);
+	return fquat(rw / Length, rx / Length, ry / Length, rz / Length);
+}
+
+// Returns the index i of the key pair [i, i + 1] bracketing AnimationTime in
+// a sorted array of key times, starting from and updating Hint.
+inline unsigned int FindKey(float AnimationTime, const float* pTimes, unsigned int NumKeys, unsigned int& Hint, unsigned int& KeysScanned)
+{
+	assert(NumKeys > 1);
+
+	unsigned int Last = NumKeys - 2;
+	unsigned int Index = Hint < Last ? Hint : Last;
+
+	if(AnimationTime >= pTimes[Index])
+	{
+		for(unsigned int Step = 0; Step < CURSOR_MAX_STEPS; Step++)
+		{
+			KeysScanned++;
+			if(Index == Last || AnimationTime < pTimes[Index + 1])
+			{
+				Hint = Index;
+				return Index;
+			}
+			Index++;
+		}
+	}
+	else
+	{
+		for(unsigned int Step = 0; Step < CURSOR_MAX_STEPS && Index > 0; Step++)
+		{
+			KeysScanned++;
+			Index--;
+			if(AnimationTime >= pTimes[Index])
+			{
+				Hint = Index;
+				return Index;
+			}
+		}
+		if(Index == 0)
+		{
+			Hint = 0;
+			return 0;
+		}
+	}
+
+	unsigned int Low = 0;
+	unsigned int High = Last;
+	while(Low < High)
+	{
+		KeysScanned++;
+		unsigned int Mid = (Low + High + 1) / 2;
+		if(AnimationTime < pTimes[Mid])
+			High = Mid - 1;
+		else
+			Low = Mid;
+	}
+	Hint = Low;
+	return Low;
+}
+
+// Runtime copy of an aiAnimation. Every time and value stream of every
+// channel is packed into the single Data block, so searching a channel only
+// touches its float times instead of Assimp's double time + value keys.
+//
+// When all tracks are keyed at the same times (Blender exports do this) the
+// times are stored once and SharedTimeline is set, which lets the sampler do
+// one search per clip instead of two per channel.
+class AnimationClip
+{
+public:
+	string Name;
+	float Duration;
+	float TicksPerSecond;
+	// Where playback wraps, in ticks: the clip's mDuration, or its last key
+	// if the file gives no duration. Past the last key the pose holds.
+	float EndTime;
+	bool SharedTimeline;
+	unsigned int NumSharedKeys;
+	unsigned int SharedTimes;
+	vector<ClipChannel> Channels;
+	vector<unsigned char> Data;
+
+	AnimationClip()
+	{
+		Duration = 0.0f;
+		TicksPerSecond = 25.0f;
+		EndTime = 0.0f;
+		SharedTimeline = false;
+		NumSharedKeys = 0;
+		SharedTimes = 0;
+	}
+
+	// Seconds until playback wraps.
+	float Length() const
+	{
+		return TicksPerSecond > 0.0f ? EndTime / TicksPerSecond : 0.0f;
+	}
+
+	void Build(const aiAnimation* pAnimation)
+	{
+		vector<ChannelKeys> keys(pAnimation->mNumChannels);
+		for(unsigned int i = 0; i < pAnimation->mNumChannels; i++)
+		{
+			const aiNodeAnim* pNodeAnim = pAnimation->mChannels[i];
+			ChannelKeys& channel = keys[i];
+			channel.NodeName = pNodeAnim->mNodeName.data;
+
+			for(unsigned int k = 0; k < pNodeAnim->mNumRotationKeys; k++)
+			{
+				const aiQuaternion& q = pNodeAnim->mRotationKeys[k].mValue;
+				channel.RotationTimes.push_back((float)pNodeAnim->mRotationKeys[k].mTime);
+				channel.Rotations.push_back(fquat(q.w, q.x, q.y, q.z));
+			}
+
+			for(unsigned int k = 0; k < pNodeAnim->mNumPositionKeys; k++)
+			{
+				const aiVector3D& v = pNodeAnim->mPositionKeys[k].mValue;
+				channel.PositionTimes.push_back((float)pNodeAnim->mPositionKeys[k].mTime);
+				channel.Positions.push_back(vec3(v.x, v.y, v.z));
+			}
+		}
+
+		float Ticks = pAnimation->mTicksPerSecond != 0 ? (float)pAnimation->mTicksPerSecond : 25.0f;
+		Build(pAnimation->mName.data, (float)pAnimation->mDuration, Ticks, keys);
+	}
+
+	// Lays the channels out in one block, encoding each value stream in the
+	// format the channel asks for.
+	void Build(const string& name, float duration, float ticksPerSecond, const vector<ChannelKeys>& keys)
+	{
+		Name = name;
+		Duration = duration;
+		TicksPerSecond = ticksPerSecond;
+		SharedTimeline = hasSharedTimeline(keys);
+		NumSharedKeys = SharedTimeline ? (unsigned int)keys[0].RotationTimes.size() : 0;
+
+		unsigned int Size = NumSharedKeys * sizeof(float);
+		for(unsigned int i = 0; i < keys.size(); i++)
+		{
+			const ChannelKeys& channel = keys[i];
+			if(!SharedTimeline)
+				Size += (unsigned int)(channel.RotationTimes.size() + channel.PositionTimes.size()) * sizeof(float);
+			Size += align((unsigned int)channel.Rotations.size() * RotationStride(channel.RotationPacking));
+			Size += align((unsigned int)channel.Positions.size() * PositionStride(channel.PositionPacking));
+		}
+		Data.assign(Size, 0);
+		Channels.resize(keys.size());
+
+		EndTime = 0.0f;
+		for(unsigned int i = 0; i < keys.size(); i++)
+		{
+			if(!keys[i].RotationTimes.empty())
+				EndTime = std::max(EndTime, keys[i].RotationTimes.back());
+			if(!keys[i].PositionTimes.empty())
+				EndTime = std::max(EndTime, keys[i].PositionTimes.back());
+		}
+		if(Duration > 0.0f)
+			EndTime = Duration;
+
+		unsigned int Offset = 0;
+		SharedTimes = Offset;
+		if(SharedTimeline)
+			Offset = writeFloats(Offset, keys[0].RotationTimes.data(), NumSharedKeys);
+
+		for(unsigned int i = 0; i < keys.size(); i++)
+		{
+			const ChannelKeys& source = keys[i];
+			ClipChannel& channel = Channels[i];
+			channel.NodeName = source.NodeName;
+			channel.NumRotationKeys = (unsigned int)source.Rotations.size();
+			channel.NumPositionKeys = (unsigned int)source.Positions.size();
+			channel.RotationPacking = source.RotationPacking;
+			channel.PositionPacking = source.PositionPacking;
+			channel.Constant = channel.NumRotationKeys <= 1 && channel.NumPositionKeys <= 1;
+
+			if(SharedTimeline)
+			{
+				channel.RotationTimes = SharedTimes;
+				channel.PositionTimes = SharedTimes;
+			}
+			else
+			{
+				channel.RotationTimes = Offset;
+				Offset = writeFloats(Offset, source.RotationTimes.data(), channel.NumRotationKeys);
+				channel.PositionTimes = Offset;
+				Offset = writeFloats(Offset, source.PositionTimes.data(), channel.NumPositionKeys);
+			}
+
+			channel.RotationValues = Offset;
+			for(unsigned int k = 0; k < channel.NumRotationKeys; k++)
+			{
+				const fquat& q = source.Rotations[k];
+				if(channel.RotationPacking == ROTATION_SMALLEST_THREE_48)
+				{
+					PackRotation48(normalize(q), (unsigned short*)&Data[Offset]);
+				}
+				else
+				{
+					float* p = (float*)&Data[Offset];
+					p[0] = q.x;
+					p[1] = q.y;
+					p[2] = q.z;
+					p[3] = q.w;
+				}
+				Offset += RotationStride(channel.RotationPacking);
+			}
+			Offset = align(Offset);
+
+			vec3 Min = channel.NumPositionKeys ? source.Positions[0] : vec3(0.0f);
+			vec3 Max = Min;
+			for(unsigned int k = 1; k < channel.NumPositionKeys; k++)
+			{
+				Min = min(Min, source.Positions[k]);
+				Max = max(Max, source.Positions[k]);
+			}
+			channel.PositionMin = Min;
+			channel.PositionExtent = Max - Min;
+
+			channel.PositionValues = Offset;
+			for(unsigned int k = 0; k < channel.NumPositionKeys; k++)
+			{
+				writePosition(Offset, channel, source.Positions[k]);
+				Offset += PositionStride(channel.PositionPacking);
+			}
+			Offset = align(Offset);
+		}
+		assert(Offset == Size);
+	}
+
+	// Decoded copy of every channel, with the values as they are stored now.
+	void Decode(vector<ChannelKeys>& keys) const
+	{
+		keys.resize(Channels.size());
+		for(unsigned int i = 0; i < Channels.size(); i++)
+		{
+			const ClipChannel& channel = Channels[i];
+			ChannelKeys& out = keys[i];
+			out.NodeName = channel.NodeName;
+			out.RotationPacking = channel.RotationPacking;
+			out.PositionPacking = channel.PositionPacking;
+			out.RotationTimes.assign(RotationTimes(channel), RotationTimes(channel) + channel.NumRotationKeys);
+			out.PositionTimes.assign(PositionTimes(channel), PositionTimes(channel) + channel.NumPositionKeys);
+			out.Rotations.resize(channel.NumRotationKeys);
+			out.Positions.resize(channel.NumPositionKeys);
+			for(unsigned int k = 0; k < channel.NumRotationKeys; k++)
+				out.Rotations[k] = Rotation(channel, k);
+			for(unsigned int k = 0; k < channel.NumPositionKeys; k++)
+				out.Positions[k] = Position(channel, k);
+		}
+	}
+
+	int FindChannel(const string& NodeName) const
+	{
+		for(unsigned int i = 0; i < Channels.size(); i++)
+			if(Channels[i].NodeName == NodeName)
+				return (int)i;
+		return INVALID_CHANNEL;
+	}
+
+	const float* RotationTimes(const ClipChannel& channel) const
+	{
+		return (const float*)&Data[channel.RotationTimes];
+	}
+
+	const float* PositionTimes(const ClipChannel& channel) const
+	{
+		return (const float*)&Data[channel.PositionTimes];
+	}
+
+	const float* SharedKeyTimes() const
+	{
+		return (const float*)&Data[SharedTimes];
+	}
+
+	fquat Rotation(const ClipChannel& channel, unsigned int Key) const
+	{
+		const unsigned char* p = &Data[channel.RotationValues + Key * RotationStride(channel.RotationPacking)];
+		if(channel.RotationPacking == ROTATION_SMALLEST_THREE_48)
+			return UnpackRotation48((const unsigned short*)p);
+
+		const float* q = (const float*)p;
+		return fquat(q[3], q[0], q[1], q[2]);
+	}
+
+	vec3 Position(const ClipChannel& channel, unsigned int Key) const
+	{
+		const unsigned char* p = &Data[channel.PositionValues + Key * PositionStride(channel.PositionPacking)];
+		if(channel.PositionPacking == POSITION_RANGE_16)
+		{
+			const unsigned short* q = (const unsigned short*)p;
+			return channel.PositionMin + channel.PositionExtent * vec3(q[0], q[1], q[2]) / 65535.0f;
+		}
+		if(channel.PositionPacking == POSITION_RANGE_8)
+			return channel.PositionMin + channel.PositionExtent * vec3(p[0], p[1], p[2]) / 255.0f;
+
+		const float* v = (const float*)p;
+		return vec3(v[0], v[1], v[2]);
+	}
+
+	// True when every rotation key of the channel holds the same value.
+	bool ConstantRotation(const ClipChannel& channel) const
+	{
+		for(unsigned int k = 1; k < channel.NumRotationKeys; k++)
+			if(Rotation(channel, k) != Rotation(channel, 0))
+				return false;
+		return true;
+	}
+
+	bool ConstantPosition(const ClipChannel& channel) const
+	{
+		for(unsigned int k = 1; k < channel.NumPositionKeys; k++)
+			if(Position(channel, k) != Position(channel, 0))
+				return false;
+		return true;
+	}
+
+	// Stateless sample of one channel, for load-time tools. The per-frame
+	// path in SkinnedModelAsset keeps cursors and uses the shared timeline instead.
+	void Sample(unsigned int Channel, float AnimationTime, fquat& OutRotation, vec3& OutPosition) const
+	{
+		const ClipChannel& channel = Channels[Channel];
+		unsigned int Hint = 0;
+		unsigned int Scanned = 0;
+
+		if(channel.NumRotationKeys == 1)
+			OutRotation = Rotation(channel, 0);
+		else
+		{
+			const float* pTimes = RotationTimes(channel);
+			unsigned int Index = FindKey(AnimationTime, pTimes, channel.NumRotationKeys, Hint, Scanned);
+			float Factor = (AnimationTime - pTimes[Index]) / (pTimes[Index + 1] - pTimes[Index]);
+			Factor = Factor < 0.0f ? 0.0f : (Factor > 1.0f ? 1.0f : Factor);
+			OutRotation = InterpolateRotation(Rotation(channel, Index), Rotation(channel, Index + 1), Factor);
+		}
+
+		if(channel.NumPositionKeys == 1)
+			OutPosition = Position(channel, 0);
+		else
+		{
+			const float* pTimes = PositionTimes(channel);
+			unsigned int Index = FindKey(AnimationTime, pTimes, channel.NumPositionKeys, Hint, Scanned);
+			float Factor = (AnimationTime - pTimes[Index]) / (pTimes[Index + 1] - pTimes[Index]);
+			Factor = Factor < 0.0f ? 0.0f : (Factor > 1.0f ? 1.0f : Factor);
+			vec3 Start = Position(channel, Index);
+			OutPosition = Start + Factor * (Position(channel, Index + 1) - Start);
+		}
+	}
+
+private:
+	static unsigned int align(unsigned int Offset)
+	{
+		return (Offset + 3) & ~3u;
+	}
+
+	unsigned int writeFloats(unsigned int Offset, const float* pValues, unsigned int Count)
+	{
+		if(Count)
+			memcpy(&Data[Offset], pValues, Count * sizeof(float));
+		return Offset + Count * sizeof(float);
+	}
+
+	void writePosition(unsigned int Offset, const ClipChannel& channel, const vec3& Value)
+	{
+		if(channel.PositionPacking == POSITION_FLOAT)
+		{
+			float* p = (float*)&Data[Offset];
+			p[0] = Value.x;
+			p[1] = Value.y;
+			p[2] = Value.z;
+			return;
+		}
+
+		float MaxValue = channel.PositionPacking == POSITION_RANGE_16 ? 65535.0f : 255.0f;
+		unsigned int q[3];
+		for(unsigned int c = 0; c < 3; c++)
+		{
+			float Unit = channel.PositionExtent[c] > 0.0f ? (Value[c] - channel.PositionMin[c]) / channel.PositionExtent[c] : 0.0f;
+			Unit = Unit < 0.0f ? 0.0f : (Unit > 1.0f ? 1.0f : Unit);
+			q[c] = (unsigned int)(Unit * MaxValue + 0.5f);
+		}
+
+		if(channel.PositionPacking == POSITION_RANGE_16)
+		{
+			unsigned short* p = (unsigned short*)&Data[Offset];
+			for(unsigned int c = 0; c < 3; c++)
+				p[c] = (unsigned short)q[c];
+		}
+		else
+		{
+			for(unsigned int c = 0; c < 3; c++)
+				Data[Offset + c] = (unsigned char)q[c];
+		}
+	}
+
+	static bool hasSharedTimeline(const vector<ChannelKeys>& keys)
+	{
+		if(keys.empty() || keys[0].RotationTimes.size() < 2)
+			return false;
+
+		const vector<float>& Times = keys[0].RotationTimes;
+		for(unsigned int i = 0; i < keys.size(); i++)
+			if(keys[i].RotationTimes != Times || keys[i].PositionTimes != Times)
+				return false;
+		return true;
+	}
+};
+
+struct ChannelCursor
+{
+	unsigned int Rotation;
+	unsigned int Position;
+
+	ChannelCursor()
+	{
+		Rotation = 0;
+		Position = 0;
+	}
+};
+
+// Per-instance sampling state: the key index each channel landed on last time,
+// so monotonic playback only walks one or two keys per channel per frame.
+struct AnimationCursor
+{
+	vector<ChannelCursor> Channels;
+	unsigned int Timeline;
+	unsigned int KeysScanned;
+
+	AnimationCursor()
+	{
+		Timeline = 0;
+		KeysScanned = 0;
+	}
+
+	void Reset(unsigned int numChannels)
+	{
+		Channels.assign(numChannels, ChannelCursor());
+		Timeline = 0;
+		KeysScanned = 0;
+	}
+};
+#endif
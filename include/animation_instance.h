@@ -0,0 +1,75 @@
+#ifndef ANIMATION_INSTANCE_H
+#define ANIMATION_INSTANCE_H
+
+#include <glm/glm.hpp>
+#include <glm\gtx\dual_quaternion.hpp>
+#include <glm\gtx\quaternion.hpp>
+
+#include "animation.h"
+#include "skinning.h"
+
+#include <vector>
+using namespace std;
+using namespace glm;
+
+// Per-character animation state. Everything here is sized by the skeleton,
+// so a crowd shares one SkinnedModelAsset and pays only for its bones.
+// SkinnedModelAsset::Evaluate reads Clip, Time and Mode and writes Palette;
+// the rest is scratch it keeps between frames.
+struct AnimationInstance
+{
+	ClipHandle Clip;
+	// Seconds into the clip. Whoever advances it wraps it to the clip
+	// length; Sample wraps it again, so longer times still loop.
+	float Time;
+	SkinningMode Mode;
+	BonePalette Palette;
+
+	// Update-rate LOD: evaluated every UpdateInterval frames, offset by
+	// UpdatePhase so a crowd at the same distance does not update at once.
+	unsigned int UpdateInterval;
+	unsigned int UpdatePhase;
+	// Skeletal LOD evaluated and drawn; culled joints keep stale transforms.
+	unsigned int LOD;
+
+	// Clip and mode the cached static joints were evaluated for; -1 until
+	// the first Evaluate.
+	int BoundClip;
+	SkinningMode BoundMode;
+	// Clip and mode of the current palette, whether sampled here or copied
+	// from a PoseCache owner; -1 until the first of either.
+	int PosedClip;
+	SkinningMode PosedMode;
+	AnimationCursor Cursor;
+	vector<fquat> LocalRotations;
+	vector<vec3> LocalTranslations;
+	vector<mat4> GlobalTransforms;
+	vector<fdualquat> GlobalTransformsDQ;
+	// HierarchyStream lanes for the hierarchy kernel: local transforms in
+	// and global transforms out. With the kernel, dynamic joints' globals
+	// live here and the arrays above only stay current for static joints.
+	vector<float> LaneLocals;
+	vector<float> LaneGlobals;
+
+	AnimationInstance()
+	{
+		Clip = 0;
+		Time = 0.0f;
+		Mode = SKINNING_DQ;
+		UpdateInterval = 1;
+		UpdatePhase = 0;
+		LOD = 0;
+		BoundClip = -1;
+		BoundMode = SKINNING_DQ;
+		PosedClip = -1;
+		PosedMode = SKINNING_DQ;
+	}
+
+	// Records that the palette now belongs to the current clip and mode.
+	void MarkPosed()
+	{
+		PosedClip = (int)Clip;
+		PosedMode = Mode;
+	}
+};
+#endif
@@ -0,0 +1,393 @@
+#ifndef BAKED_PALETTES_H
+#define BAKED_PALETTES_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+#include <glm\gtx\dual_quaternion.hpp>
+
+#include "model.h"
+#include "shader.h"
+#include "skinning.h"
+
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace glm;
+
+// Bumped whenever the layout or the way poses are evaluated changes, so
+// older bakes are rebuilt. 2: joints without a channel keep their bind
+// transform on the dual quaternion path; the hash covers the skeleton.
+#define BAKE_FILE_VERSION 2
+
+// Frames of one clip inside BakedPalettes::Texels. Frame f holds the pose at
+// f * Length / NumFrames; the clip loops, so frame NumFrames is frame 0.
+struct BakedClip
+{
+	string Name;
+	float Length;
+	unsigned int FirstFrame;
+	unsigned int NumFrames;
+};
+
+// Every clip of an asset evaluated at a fixed rate, stored as one RGBA32F
+// buffer texture read by the BAKED_PALETTES variants of shaders/skinning.vs
+// (dual quaternions, two texels per bone, or 3x4 matrices, three texels
+// per bone). Characters played from it need no CPU work besides
+// setting their clip and time.
+class BakedPalettes
+{
+public:
+	SkinningMode Mode;
+	float SampleRate;
+	unsigned int NumBones;
+	// Identifies the clips and bind pose the bake came from; a cache file
+	// with another hash is stale.
+	unsigned long long SourceHash;
+	vector<BakedClip> Clips;
+	vector<vec4> Texels;
+
+	BakedPalettes()
+	{
+		Mode = SKINNING_DQ;
+		SampleRate = 0.0f;
+		NumBones = 0;
+		SourceHash = 0;
+		m_Buffer = 0;
+		m_Texture = 0;
+	}
+
+	unsigned int TexelsPerBone() const
+	{
+		return Mode == SKINNING_DQ ? 2 : 3;
+	}
+
+	// Evaluates every clip at SampleRate frames per second. LBS is baked as
+	// SKINNING_AFFINE, which is the same transform in fewer texels.
+	void Bake(const SkinnedModelAsset& Asset, SkinningMode mode, float sampleRate)
+	{
+		Mode = mode == SKINNING_DQ ? SKINNING_DQ : SKINNING_AFFINE;
+		SampleRate = sampleRate;
+		NumBones = Asset.m_NumBones;
+		SourceHash = Hash(Asset);
+		Clips.clear();
+		Texels.clear();
+
+		unsigned int NumFrames = 0;
+		for(unsigned int c = 0; c < Asset.Clips.size(); c++)
+		{
+			BakedClip clip;
+			clip.Name = Asset.Clips[c].Name;
+			clip.Length = Asset.Clips[c].Length();
+			clip.FirstFrame = NumFrames;
+			clip.NumFrames = (unsigned int)std::max(1.0f, ceil(clip.Length * SampleRate));
+			Clips.push_back(clip);
+			NumFrames += clip.NumFrames;
+
+			AnimationInstance Instance;
+			Instance.Clip = c;
+			Instance.Mode = Mode;
+			for(unsigned int f = 0; f < clip.NumFrames; f++)
+			{
+				Instance.Time = clip.Length * f / clip.NumFrames;
+				Asset.Evaluate(Instance);
+				appendPalette(Instance.Palette);
+			}
+		}
+	}
+
+	// Reads a bake written by Save. Returns false if the file is missing or
+	// was baked from different data or settings, in which case the caller
+	// bakes again.
+	bool Load(const string& path, const SkinnedModelAsset& Asset, SkinningMode mode, float sampleRate)
+	{
+		ifstream file(path.c_str(), ios::binary);
+		if(!file)
+			return false;
+
+		unsigned int Version = 0, FileMode = 0, NumClips = 0, NumTexels = 0;
+		float FileRate = 0.0f;
+		unsigned long long FileHash = 0;
+		unsigned int FileBones = 0;
+		read(file, Version);
+		read(file, FileMode);
+		read(file, FileRate);
+		read(file, FileBones);
+		read(file, FileHash);
+		read(file, NumClips);
+
+		SkinningMode Expected = mode == SKINNING_DQ ? SKINNING_DQ : SKINNING_AFFINE;
+		if(!file || Version != BAKE_FILE_VERSION || FileMode != (unsigned int)Expected || FileRate != sampleRate
+			|| FileBones != Asset.m_NumBones || FileHash != Hash(Asset) || NumClips != Asset.Clips.size())
+			return false;
+
+		vector<BakedClip> FileClips(NumClips);
+		for(unsigned int c = 0; c < NumClips; c++)
+		{
+			unsigned int NameLength = 0;
+			read(file, NameLength);
+			FileClips[c].Name.resize(NameLength);
+			if(NameLength > 0)
+				file.read(&FileClips[c].Name[0], NameLength);
+			read(file, FileClips[c].Length);
+			read(file, FileClips[c].FirstFrame);
+			read(file, FileClips[c].NumFrames);
+		}
+
+		read(file, NumTexels);
+		vector<vec4> FileTexels(NumTexels);
+		if(NumTexels > 0)
+			file.read((char*)&FileTexels[0], NumTexels * sizeof(vec4));
+		if(!file)
+			return false;
+
+		Mode = Expected;
+		SampleRate = FileRate;
+		NumBones = FileBones;
+		SourceHash = FileHash;
+		Clips.swap(FileClips);
+		Texels.swap(FileTexels);
+		return true;
+	}
+
+	bool Save(const string& path) const
+	{
+		ofstream file(path.c_str(), ios::binary);
+		if(!file)
+			return false;
+
+		write(file, (unsigned int)BAKE_FILE_VERSION);
+		write(file, (unsigned int)Mode);
+		write(file, SampleRate);
+		write(file, NumBones);
+		write(file, SourceHash);
+		write(file, (unsigned int)Clips.size());
+		for(unsigned int c = 0; c < Clips.size(); c++)
+		{
+			write(file, (unsigned int)Clips[c].Name.size());
+			file.write(Clips[c].Name.data(), Clips[c].Name.size());
+			write(file, Clips[c].Length);
+			write(file, Clips[c].FirstFrame);
+			write(file, Clips[c].NumFrames);
+		}
+		write(file, (unsigned int)Texels.size());
+		if(!Texels.empty())
+			file.write((const char*)&Texels[0], Texels.size() * sizeof(vec4));
+		return (bool)file;
+	}
+
+	// Load, or bake and save if the cache at path is missing or stale.
+	void LoadOrBake(const string& path, const SkinnedModelAsset& Asset, SkinningMode mode, float sampleRate)
+	{
+		if(Load(path, Asset, mode, sampleRate))
+		{
+			cout << "BAKE::loaded " << path << endl;
+			return;
+		}
+
+		Bake(Asset, mode, sampleRate);
+		if(!Save(path))
+			cout << "ERROR::BAKE::FILE_NOT_SUCCESFULLY_WRITTEN " << path << endl;
+		cout << "BAKE::baked " << Texels.size() * sizeof(vec4) << " bytes to " << path << endl;
+	}
+
+	// Creates the buffer texture. Needs a GL context.
+	void Upload()
+	{
+		glGenBuffers(1, &m_Buffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, m_Buffer);
+		glBufferData(GL_TEXTURE_BUFFER, Texels.size() * sizeof(vec4), Texels.empty() ? NULL : &Texels[0], GL_STATIC_DRAW);
+
+		glGenTextures(1, &m_Texture);
+		glBindTexture(GL_TEXTURE_BUFFER, m_Texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, m_Buffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+
+	// Binds the texture to Unit for a baked skinning program in use.
+	void Bind(const Shader& shader, unsigned int Unit) const
+	{
+		glActiveTexture(GL_TEXTURE0 + Unit);
+		glBindTexture(GL_TEXTURE_BUFFER, m_Texture);
+		glActiveTexture(GL_TEXTURE0);
+		shader.setInt("gBakedPalettes", Unit);
+		shader.setInt("gBonesPerFrame", NumBones);
+	}
+
+	// Per-character uniforms: which clip and how far into it.
+	void SetInstance(const Shader& shader, unsigned int Clip, float Time) const
+	{
+		const BakedClip& clip = Clips[Clip];
+		shader.setInt("gFirstFrame", clip.FirstFrame);
+		shader.setInt("gNumFrames", clip.NumFrames);
+		shader.setFloat("gClipLength", clip.Length);
+		shader.setFloat("gClipTime", clip.Length > 0.0f ? fmod(Time, clip.Length) : 0.0f);
+	}
+
+	// Bone's palette entry at Time, interpolated the way the shaders do it.
+	mat2x4 SampleDQ(unsigned int Clip, float Time, unsigned int Bone) const
+	{
+		unsigned int Frame0, Frame1;
+		float Factor = bracket(Clip, Time, Frame0, Frame1);
+
+		vec4 Real0 = Texels[texel(Frame0, Bone)], Dual0 = Texels[texel(Frame0, Bone) + 1];
+		vec4 Real1 = Texels[texel(Frame1, Bone)], Dual1 = Texels[texel(Frame1, Bone) + 1];
+		if(dot(Real0, Real1) < 0.0f)
+		{
+			Real1 = -Real1;
+			Dual1 = -Dual1;
+		}
+		return mat2x4(mix(Real0, Real1, Factor), mix(Dual0, Dual1, Factor));
+	}
+
+	mat3x4 SampleAffine(unsigned int Clip, float Time, unsigned int Bone) const
+	{
+		unsigned int Frame0, Frame1;
+		float Factor = bracket(Clip, Time, Frame0, Frame1);
+
+		mat3x4 Result;
+		for(unsigned int r = 0; r < 3; r++)
+			Result[r] = mix(Texels[texel(Frame0, Bone) + r], Texels[texel(Frame1, Bone) + r], Factor);
+		return Result;
+	}
+
+	// Largest difference, over SamplesPerClip times per clip, between the
+	// interpolated bake and SkinnedModelAsset::Evaluate, comparing each bone
+	// as a 3x4 matrix (rotation terms and model-unit translations). With
+	// OnFrames the times are the baked frames themselves, which checks the
+	// bake; otherwise they fall between frames, which also measures the
+	// interpolation error.
+	float Verify(const SkinnedModelAsset& Asset, unsigned int SamplesPerClip, bool OnFrames) const
+	{
+		float MaxError = 0.0f;
+		for(unsigned int c = 0; c < Clips.size(); c++)
+		{
+			const BakedClip& clip = Clips[c];
+			AnimationInstance Instance;
+			Instance.Clip = c;
+			Instance.Mode = Mode;
+
+			for(unsigned int s = 0; s < SamplesPerClip; s++)
+			{
+				float Frame = (float)s * clip.NumFrames / SamplesPerClip;
+				Frame = OnFrames ? floor(Frame) : floor(Frame) + 0.5f;
+				Instance.Time = clip.Length * Frame / clip.NumFrames;
+				Asset.Evaluate(Instance);
+
+				for(unsigned int b = 0; b < NumBones; b++)
+				{
+					mat3x4 Expected, Baked;
+					if(Mode == SKINNING_DQ)
+					{
+						Expected = mat3x4_cast(normalize(dualquat_cast(Instance.Palette.DualQuaternions[b])));
+						Baked = mat3x4_cast(normalize(dualquat_cast(SampleDQ(c, Instance.Time, b))));
+					}
+					else
+					{
+						Expected = Instance.Palette.Affine[b];
+						Baked = SampleAffine(c, Instance.Time, b);
+					}
+
+					for(unsigned int r = 0; r < 3; r++)
+						for(unsigned int k = 0; k < 4; k++)
+							MaxError = std::max(MaxError, fabs(Expected[r][k] - Baked[r][k]));
+				}
+			}
+		}
+		return MaxError;
+	}
+
+	// FNV-1a over the packed clips, the skeleton's hierarchy and bind
+	// transforms, the global inverse and the bone offsets, which is
+	// everything a bake depends on besides its mode, its rate and
+	// BAKE_FILE_VERSION.
+	static unsigned long long Hash(const SkinnedModelAsset& Asset)
+	{
+		unsigned long long Hash = 14695981039346656037ULL;
+		for(unsigned int c = 0; c < Asset.Clips.size(); c++)
+		{
+			const AnimationClip& clip = Asset.Clips[c];
+			hashBytes(Hash, clip.Name.data(), clip.Name.size());
+			hashBytes(Hash, &clip.EndTime, sizeof(float));
+			hashBytes(Hash, &clip.TicksPerSecond, sizeof(float));
+			if(!clip.Data.empty())
+				hashBytes(Hash, &clip.Data[0], clip.Data.size());
+		}
+		for(unsigned int i = 0; i < Asset.m_Skeleton.NumJoints(); i++)
+		{
+			const Joint& joint = Asset.m_Skeleton.Joints[i];
+			hashBytes(Hash, &joint.Parent, sizeof(int));
+			hashBytes(Hash, &joint.BoneIndex, sizeof(int));
+			hashBytes(Hash, &joint.LocalTransformation, sizeof(mat4));
+		}
+		hashBytes(Hash, &Asset.m_GlobalInverseTransform, sizeof(mat4));
+		for(unsigned int b = 0; b < Asset.m_BoneInfo.size(); b++)
+			hashBytes(Hash, &Asset.m_BoneInfo[b].offset, sizeof(mat4));
+		return Hash;
+	}
+
+private:
+	unsigned int m_Buffer;
+	unsigned int m_Texture;
+
+	void appendPalette(const BonePalette& Palette)
+	{
+		for(unsigned int b = 0; b < NumBones; b++)
+		{
+			if(Mode == SKINNING_DQ)
+			{
+				Texels.push_back(Palette.DualQuaternions[b][0]);
+				Texels.push_back(Palette.DualQuaternions[b][1]);
+			}
+			else
+			{
+				Texels.push_back(Palette.Affine[b][0]);
+				Texels.push_back(Palette.Affine[b][1]);
+				Texels.push_back(Palette.Affine[b][2]);
+			}
+		}
+	}
+
+	unsigned int texel(unsigned int Frame, unsigned int Bone) const
+	{
+		return (Frame * NumBones + Bone) * TexelsPerBone();
+	}
+
+	// Absolute frames around Time and the blend factor between them.
+	float bracket(unsigned int Clip, float Time, unsigned int& Frame0, unsigned int& Frame1) const
+	{
+		const BakedClip& clip = Clips[Clip];
+		float Phase = clip.Length > 0.0f ? Time / clip.Length : 0.0f;
+		Phase -= floor(Phase);
+
+		float Frame = Phase * clip.NumFrames;
+		unsigned int Index = std::min((unsigned int)Frame, clip.NumFrames - 1);
+		Frame0 = clip.FirstFrame + Index;
+		Frame1 = clip.FirstFrame + (Index + 1) % clip.NumFrames;
+		return Frame - Index;
+	}
+
+	static void hashBytes(unsigned long long& Hash, const void* pData, size_t Size)
+	{
+		const unsigned char* pBytes = (const unsigned char*)pData;
+		for(size_t i = 0; i < Size; i++)
+		{
+			Hash ^= pBytes[i];
+			Hash *= 1099511628211ULL;
+		}
+	}
+
+	template<typename T> static void read(ifstream& file, T& Value)
+	{
+		file.read((char*)&Value, sizeof(T));
+	}
+
+	template<typename T> static void write(ofstream& file, const T& Value)
+	{
+		file.write((const char*)&Value, sizeof(T));
+	}
+};
+#endif
@@ -0,0 +1,28 @@
+#ifndef CLIP_BINDING_H
+#define CLIP_BINDING_H
+
+#include "animation.h"
+#include "skeleton.h"
+#include "rotation_sampler.h"
+#include "hierarchy_kernel.h"
+
+#include <vector>
+using namespace std;
+
+// Everything that depends on which clip drives the skeleton, built once
+// per clip at load. BoundSkeleton is the asset's skeleton with each joint's
+// channel in this clip resolved (Joint::Channel is the joint-to-channel
+// table) and its motion classified from that channel; the skeletal LODs'
+// joint lists and the kernel layouts follow from it. An instance switches
+// clips by changing its ClipHandle, which only changes the binding it reads.
+struct ClipBinding
+{
+	Skeleton BoundSkeleton;
+	vector<SkeletonLOD> LODs;
+	// Shared by every skeletal LOD; empty for clips without a shared
+	// timeline.
+	RotationStream Rotations;
+	// Per skeletal LOD.
+	vector<HierarchyStream> HierarchyStreams;
+};
+#endif
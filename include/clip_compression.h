@@ -0,0 +1,507 @@
+#ifndef CLIP_COMPRESSION_H
+#define CLIP_COMPRESSION_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm\gtx\quaternion.hpp>
+
+#include <assimp/scene.h>
+
+#include "animation.h"
+#include "skeleton.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace glm;
+
+struct ClipCompressionSettings
+{
+	// Drop keys that interpolation between their neighbours reproduces.
+	bool ReduceKeys;
+	// Store values in the smallest packed formats that meet the budget.
+	bool Quantize;
+	// Largest allowed displacement of any bone tip, in millimetres. Key
+	// reduction may use up to KeyToleranceMM of it.
+	float ErrorBudgetMM;
+	float KeyToleranceMM;
+	// Model units per metre, used to turn the budget into model units.
+	float UnitsPerMeter;
+	// Budget and key tolerance for single clips, by name, e.g. a tighter one
+	// for a close-up clip. Clips not listed use the two above.
+	map<string, pair<float, float> > ClipBudgetsMM;
+
+	ClipCompressionSettings()
+	{
+		ReduceKeys = false;
+		Quantize = false;
+		ErrorBudgetMM = 0.5f;
+		KeyToleranceMM = 0.25f;
+		UnitsPerMeter = 1.0f;
+	}
+
+	void SetClipBudget(const string& Clip, float BudgetMM, float ToleranceMM)
+	{
+		ClipBudgetsMM[Clip] = make_pair(BudgetMM, ToleranceMM);
+	}
+
+	// The settings the named clip is compressed with.
+	ClipCompressionSettings ForClip(const string& Clip) const
+	{
+		ClipCompressionSettings settings = *this;
+		map<string, pair<float, float> >::const_iterator budget = ClipBudgetsMM.find(Clip);
+		if(budget != ClipBudgetsMM.end())
+		{
+			settings.ErrorBudgetMM = budget->second.first;
+			settings.KeyToleranceMM = budget->second.second;
+		}
+		return settings;
+	}
+};
+
+struct ClipCompressionReport
+{
+	string Name;
+	unsigned int SourceBytes;
+	unsigned int RawBytes;
+	unsigned int CompressedBytes;
+	unsigned int SourceKeys;
+	unsigned int Keys;
+	unsigned int ConstantChannels;
+	float MaxErrorMM;
+	// Whether the clip shared one timeline before and after compression.
+	bool SourceSharedTimeline;
+	bool SharedTimeline;
+
+	ClipCompressionReport()
+	{
+		SourceSharedTimeline = false;
+		SharedTimeline = false;
+		SourceKeys = 0;
+		Keys = 0;
+		ConstantChannels = 0;
+		SourceBytes = 0;
+		RawBytes = 0;
+		CompressedBytes = 0;
+		MaxErrorMM = 0.0f;
+	}
+};
+
+// Load-time clip processing. Both passes measure error in model space at
+// each joint and at points one bone length along its three axes, so a small
+// rotation error near the root is charged for the whole limb, and always
+// against the clip as imported.
+//
+// Key reduction removes keys that interpolating their neighbours reproduces
+// within a per-channel tolerance, judged at the channel's subtree radius.
+// On a shared timeline a time is removed from every channel or none, so the
+// clip keeps its shared timeline.
+// Whenever the accumulated hierarchy is still over KeyToleranceMM, the
+// tolerances on the worst joint's chain are halved and the channels rebuilt.
+//
+// Quantization starts every channel at its smallest format; while the worst
+// joint is over budget, the lossy streams on its chain are promoted one step
+// (range 8 -> range 16 -> float, smallest-three -> float).
+class ClipCompressor
+{
+public:
+	static ClipCompressionReport Compress(AnimationClip& clip, const aiAnimation* pSource, const Skeleton& skeleton, const ClipCompressionSettings& settings)
+	{
+		ClipCompressionReport report;
+		report.Name = clip.Name;
+		report.SourceBytes = sourceBytes(pSource);
+		report.RawBytes = (unsigned int)clip.Data.size();
+		report.SourceSharedTimeline = clip.SharedTimeline;
+
+		const AnimationClip reference = clip;
+		float ToUnits = 0.001f * settings.UnitsPerMeter;
+
+		vector<float> TipLengths;
+		tipLengths(skeleton, TipLengths);
+
+		vector<float> Times;
+		sampleTimes(reference, Times);
+
+		vector<ChannelKeys> keys;
+		clip.Decode(keys);
+		report.SourceKeys = countKeys(keys);
+
+		vector<float> JointErrors;
+		if(settings.ReduceKeys)
+			reduce(clip, keys, reference, skeleton, TipLengths, Times, settings.KeyToleranceMM * ToUnits);
+
+		if(settings.Quantize)
+			quantize(clip, keys, reference, skeleton, TipLengths, Times, settings.ErrorBudgetMM * ToUnits);
+
+		report.Keys = countKeys(keys);
+		for(unsigned int i = 0; i < clip.Channels.size(); i++)
+			if(clip.Channels[i].Constant)
+				report.ConstantChannels++;
+
+		report.MaxErrorMM = measure(reference, clip, skeleton, TipLengths, Times, JointErrors) / ToUnits;
+		report.CompressedBytes = (unsigned int)clip.Data.size();
+		report.SharedTimeline = clip.SharedTimeline;
+		return report;
+	}
+
+private:
+	static void reduce(AnimationClip& clip, vector<ChannelKeys>& keys, const AnimationClip& reference, const Skeleton& skeleton, const vector<float>& TipLengths, const vector<float>& Times, float Tolerance)
+	{
+		vector<float> Radii;
+		subtreeRadii(skeleton, TipLengths, Radii);
+
+		// Channels no joint reads stay at -1 and are not judged.
+		vector<float> ChannelRadii(keys.size(), -1.0f);
+		for(unsigned int i = 0; i < skeleton.NumJoints(); i++)
+			if(skeleton.Joints[i].Channel != INVALID_CHANNEL)
+				ChannelRadii[skeleton.Joints[i].Channel] = Radii[i];
+
+		const vector<ChannelKeys> source = keys;
+		vector<float> Tolerances(keys.size(), Tolerance);
+		vector<float> JointErrors;
+		for(;;)
+		{
+			if(reference.SharedTimeline)
+				reduceSharedKeys(keys, source, Tolerances, ChannelRadii);
+			else
+			{
+				for(unsigned int Channel = 0; Channel < keys.size(); Channel++)
+				{
+					if(ChannelRadii[Channel] < 0.0f)
+						continue;
+
+					ChannelKeys& channel = keys[Channel];
+					channel = source[Channel];
+					reduceKeys(channel.RotationTimes, channel.Rotations, Tolerances[Channel], ChannelRadii[Channel]);
+					reduceKeys(channel.PositionTimes, channel.Positions, Tolerances[Channel], ChannelRadii[Channel]);
+				}
+			}
+
+			clip.Build(reference.Name, reference.Duration, reference.TicksPerSecond, keys);
+			if(measure(reference, clip, skeleton, TipLengths, Times, JointErrors) <= Tolerance)
+				return;
+
+			unsigned int Worst = (unsigned int)(max_element(JointErrors.begin(), JointErrors.end()) - JointErrors.begin());
+			bool Tightened = false;
+			for(int j = (int)Worst; j != INVALID_JOINT; j = skeleton.Joints[j].Parent)
+			{
+				int Channel = skeleton.Joints[j].Channel;
+				if(Channel == INVALID_CHANNEL || Tolerances[Channel] == 0.0f)
+					continue;
+
+				Tolerances[Channel] *= 0.5f;
+				if(Tolerances[Channel] < Tolerance * 0.001f)
+					Tolerances[Channel] = 0.0f;
+				Tightened = true;
+			}
+
+			if(!Tightened)
+				return;
+		}
+	}
+
+	static void quantize(AnimationClip& clip, vector<ChannelKeys>& keys, const AnimationClip& reference, const Skeleton& skeleton, const vector<float>& TipLengths, const vector<float>& Times, float Budget)
+	{
+		for(unsigned int i = 0; i < keys.size(); i++)
+		{
+			keys[i].RotationPacking = ROTATION_SMALLEST_THREE_48;
+			keys[i].PositionPacking = POSITION_RANGE_8;
+		}
+
+		vector<float> JointErrors;
+		for(;;)
+		{
+			clip.Build(reference.Name, reference.Duration, reference.TicksPerSecond, keys);
+			if(measure(reference, clip, skeleton, TipLengths, Times, JointErrors) <= Budget)
+				return;
+
+			unsigned int Worst = (unsigned int)(max_element(JointErrors.begin(), JointErrors.end()) - JointErrors.begin());
+			bool Promoted = false;
+			for(int j = (int)Worst; j != INVALID_JOINT; j = skeleton.Joints[j].Parent)
+			{
+				int Channel = skeleton.Joints[j].Channel;
+				if(Channel != INVALID_CHANNEL)
+					Promoted |= promote(keys[Channel]);
+			}
+
+			if(!Promoted)
+				return;
+		}
+	}
+
+	// Greedy pass over one stream: a key is dropped when every original key
+	// between the last kept key and the next one is reproduced within
+	// Tolerance. A stream that stays within Tolerance of its first key
+	// collapses to that single key.
+	template<typename T>
+	static void reduceKeys(vector<float>& Times, vector<T>& Values, float Tolerance, float Radius)
+	{
+		unsigned int NumKeys = (unsigned int)Values.size();
+		if(NumKeys < 2)
+			return;
+
+		bool Constant = true;
+		for(unsigned int k = 1; k < NumKeys && Constant; k++)
+			Constant = keyError(Values[0], Values[k], Radius) <= Tolerance;
+
+		if(Constant)
+		{
+			Times.resize(1);
+			Values.resize(1);
+			return;
+		}
+
+		vector<float> KeptTimes(1, Times[0]);
+		vector<T> KeptValues(1, Values[0]);
+		unsigned int Anchor = 0;
+		for(unsigned int k = 1; k + 1 < NumKeys; k++)
+		{
+			if(!removable(Times, Values, Anchor, k, Tolerance, Radius))
+			{
+				KeptTimes.push_back(Times[k]);
+				KeptValues.push_back(Values[k]);
+				Anchor = k;
+			}
+		}
+		KeptTimes.push_back(Times[NumKeys - 1]);
+		KeptValues.push_back(Values[NumKeys - 1]);
+
+		Times.swap(KeptTimes);
+		Values.swap(KeptValues);
+	}
+
+	// The same greedy pass over the shared timeline of every channel: a time
+	// is dropped only when all judged channels, rotations and positions,
+	// stay within their tolerances without it. First and last keys are kept,
+	// so the result is still a shared timeline.
+	static void reduceSharedKeys(vector<ChannelKeys>& keys, const vector<ChannelKeys>& source, const vector<float>& Tolerances, const vector<float>& ChannelRadii)
+	{
+		const vector<float>& Times = source[0].RotationTimes;
+		unsigned int NumKeys = (unsigned int)Times.size();
+
+		vector<unsigned int> Kept(1, 0);
+		unsigned int Anchor = 0;
+		for(unsigned int k = 1; k + 1 < NumKeys; k++)
+		{
+			bool Removable = true;
+			for(unsigned int c = 0; c < source.size() && Removable; c++)
+			{
+				if(ChannelRadii[c] < 0.0f)
+					continue;
+				Removable = removable(Times, source[c].Rotations, Anchor, k, Tolerances[c], ChannelRadii[c]) &&
+					removable(Times, source[c].Positions, Anchor, k, Tolerances[c], ChannelRadii[c]);
+			}
+
+			if(!Removable)
+			{
+				Kept.push_back(k);
+				Anchor = k;
+			}
+		}
+		Kept.push_back(NumKeys - 1);
+
+		for(unsigned int c = 0; c < source.size(); c++)
+		{
+			ChannelKeys& channel = keys[c];
+			channel = source[c];
+			channel.RotationTimes.resize(Kept.size());
+			channel.Rotations.resize(Kept.size());
+			channel.PositionTimes.resize(Kept.size());
+			channel.Positions.resize(Kept.size());
+			for(unsigned int k = 0; k < Kept.size(); k++)
+			{
+				channel.RotationTimes[k] = channel.PositionTimes[k] = Times[Kept[k]];
+				channel.Rotations[k] = source[c].Rotations[Kept[k]];
+				channel.Positions[k] = source[c].Positions[Kept[k]];
+			}
+		}
+	}
+
+	// Whether interpolating from key Anchor to key k + 1 reproduces every
+	// key in between within Tolerance.
+	template<typename T>
+	static bool removable(const vector<float>& Times, const vector<T>& Values, unsigned int Anchor, unsigned int k, float Tolerance, float Radius)
+	{
+		for(unsigned int i = Anchor + 1; i <= k; i++)
+		{
+			float Factor = (Times[i] - Times[Anchor]) / (Times[k + 1] - Times[Anchor]);
+			if(keyError(interpolate(Values[Anchor], Values[k + 1], Factor), Values[i], Radius) > Tolerance)
+				return false;
+		}
+		return true;
+	}
+
+	static fquat interpolate(const fquat& Start, const fquat& End, float Factor)
+	{
+		return InterpolateRotation(Start, End, Factor);
+	}
+
+	static vec3 interpolate(const vec3& Start, const vec3& End, float Factor)
+	{
+		return Start + Factor * (End - Start);
+	}
+
+	// Chord length swept by a point at Radius between the two rotations.
+	static float keyError(const fquat& a, const fquat& b, float Radius)
+	{
+		float Dot = std::min(fabs(dot(a, b)), 1.0f);
+		return 2.0f * Radius * sqrt(1.0f - Dot * Dot);
+	}
+
+	static float keyError(const vec3& a, const vec3& b, float)
+	{
+		return length(a - b);
+	}
+
+	static unsigned int countKeys(const vector<ChannelKeys>& keys)
+	{
+		unsigned int Count = 0;
+		for(unsigned int i = 0; i < keys.size(); i++)
+			Count += (unsigned int)(keys[i].Rotations.size() + keys[i].Positions.size());
+		return Count;
+	}
+
+	static bool promote(ChannelKeys& channel)
+	{
+		bool Promoted = false;
+		if(channel.RotationPacking == ROTATION_SMALLEST_THREE_48)
+		{
+			channel.RotationPacking = ROTATION_FLOAT;
+			Promoted = true;
+		}
+		if(channel.PositionPacking == POSITION_RANGE_8)
+		{
+			channel.PositionPacking = POSITION_RANGE_16;
+			Promoted = true;
+		}
+		else if(channel.PositionPacking == POSITION_RANGE_16)
+		{
+			channel.PositionPacking = POSITION_FLOAT;
+			Promoted = true;
+		}
+		return Promoted;
+	}
+
+	// Size of the clip as Assimp holds it: a double time next to every value.
+	static unsigned int sourceBytes(const aiAnimation* pSource)
+	{
+		unsigned int Size = 0;
+		for(unsigned int i = 0; i < pSource->mNumChannels; i++)
+		{
+			const aiNodeAnim* pNodeAnim = pSource->mChannels[i];
+			Size += pNodeAnim->mNumRotationKeys * sizeof(aiQuatKey);
+			Size += pNodeAnim->mNumPositionKeys * sizeof(aiVectorKey);
+			Size += pNodeAnim->mNumScalingKeys * sizeof(aiVectorKey);
+		}
+		return Size;
+	}
+
+	// Bone length of each joint: the distance to its furthest child, or the
+	// parent's length for leaves.
+	static void tipLengths(const Skeleton& skeleton, vector<float>& Lengths)
+	{
+		Lengths.assign(skeleton.NumJoints(), 0.0f);
+		for(unsigned int i = 0; i < skeleton.NumJoints(); i++)
+		{
+			int Parent = skeleton.Joints[i].Parent;
+			if(Parent != INVALID_JOINT)
+			{
+				const mat4& Local = skeleton.Joints[i].LocalTransformation;
+				Lengths[Parent] = std::max(Lengths[Parent], length(vec3(Local[3][0], Local[3][1], Local[3][2])));
+			}
+		}
+		for(unsigned int i = 0; i < skeleton.NumJoints(); i++)
+		{
+			int Parent = skeleton.Joints[i].Parent;
+			if(Lengths[i] == 0.0f && Parent != INVALID_JOINT)
+				Lengths[i] = Lengths[Parent];
+		}
+	}
+
+	// Furthest bind-pose distance from each joint to any tip in its subtree.
+	static void subtreeRadii(const Skeleton& skeleton, const vector<float>& TipLengths, vector<float>& Radii)
+	{
+		vector<vec3> Origins(skeleton.NumJoints());
+		vector<mat4> Globals(skeleton.NumJoints());
+		for(unsigned int i = 0; i < skeleton.NumJoints(); i++)
+		{
+			const Joint& joint = skeleton.Joints[i];
+			Globals[i] = joint.Parent != INVALID_JOINT ? Globals[joint.Parent] * joint.LocalTransformation : joint.LocalTransformation;
+			Origins[i] = vec3(Globals[i][3][0], Globals[i][3][1], Globals[i][3][2]);
+		}
+
+		Radii = TipLengths;
+		for(unsigned int i = 0; i < skeleton.NumJoints(); i++)
+			for(int j = skeleton.Joints[i].Parent; j != INVALID_JOINT; j = skeleton.Joints[j].Parent)
+				Radii[j] = std::max(Radii[j], length(Origins[i] - Origins[j]) + TipLengths[i]);
+	}
+
+	// Every key time plus the midpoints between them, where slerp error peaks.
+	static void sampleTimes(const AnimationClip& clip, vector<float>& Times)
+	{
+		Times.clear();
+		for(unsigned int i = 0; i < clip.Channels.size(); i++)
+		{
+			const ClipChannel& channel = clip.Channels[i];
+			const float* pRotationTimes = clip.RotationTimes(channel);
+			const float* pPositionTimes = clip.PositionTimes(channel);
+			Times.insert(Times.end(), pRotationTimes, pRotationTimes + channel.NumRotationKeys);
+			Times.insert(Times.end(), pPositionTimes, pPositionTimes + channel.NumPositionKeys);
+			if(clip.SharedTimeline)
+				break;
+		}
+		sort(Times.begin(), Times.end());
+		Times.erase(unique(Times.begin(), Times.end()), Times.end());
+
+		unsigned int NumKeys = (unsigned int)Times.size();
+		for(unsigned int i = 0; i + 1 < NumKeys; i++)
+			Times.push_back((Times[i] + Times[i + 1]) * 0.5f);
+	}
+
+	static void evaluate(const AnimationClip& clip, const Skeleton& skeleton, float AnimationTime, vector<mat4>& Globals)
+	{
+		Globals.resize(skeleton.NumJoints());
+		for(unsigned int i = 0; i < skeleton.NumJoints(); i++)
+		{
+			const Joint& joint = skeleton.Joints[i];
+			mat4 NodeTransformation = joint.LocalTransformation;
+			if(joint.Channel != INVALID_CHANNEL)
+			{
+				fquat Rotation;
+				vec3 Translation;
+				clip.Sample(joint.Channel, AnimationTime, Rotation, Translation);
+				NodeTransformation = translate(mat4(1.0f), Translation) * toMat4(Rotation);
+			}
+			Globals[i] = joint.Parent != INVALID_JOINT ? Globals[joint.Parent] * NodeTransformation : NodeTransformation;
+		}
+	}
+
+	static float measure(const AnimationClip& reference, const AnimationClip& clip, const Skeleton& skeleton, const vector<float>& TipLengths, const vector<float>& Times, vector<float>& JointErrors)
+	{
+		JointErrors.assign(skeleton.NumJoints(), 0.0f);
+		vector<mat4> Expected, Actual;
+		float MaxError = 0.0f;
+
+		for(unsigned int t = 0; t < Times.size(); t++)
+		{
+			evaluate(reference, skeleton, Times[t], Expected);
+			evaluate(clip, skeleton, Times[t], Actual);
+
+			for(unsigned int i = 0; i < skeleton.NumJoints(); i++)
+			{
+				float Tip = TipLengths[i];
+				vec4 Points[4] = { vec4(0.0f, 0.0f, 0.0f, 1.0f), vec4(Tip, 0.0f, 0.0f, 1.0f), vec4(0.0f, Tip, 0.0f, 1.0f), vec4(0.0f, 0.0f, Tip, 1.0f) };
+				for(unsigned int p = 0; p < 4; p++)
+				{
+					float Error = length(vec3(Expected[i] * Points[p]) - vec3(Actual[i] * Points[p]));
+					JointErrors[i] = std::max(JointErrors[i], Error);
+					MaxError = std::max(MaxError, Error);
+				}
+			}
+		}
+		return MaxError;
+	}
+};
+#endif
@@ -0,0 +1,311 @@
+#ifndef CPU_SKINNING_H
+#define CPU_SKINNING_H
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+#include "skinning.h"
+#include "rotation_sampler.h"
+#include "hierarchy_kernel.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+using namespace std;
+using namespace glm;
+
+// Rest position x, y, z then normal x, y, z.
+#define SKINNING_REST_COMPONENTS 6
+// Blocks of vertices one call of the skinning job covers.
+#define SKINNING_GRAIN 64
+
+// Bone IDs and weights of one bone stream, block-major like
+// SkinningStream::Rest: influence k of lane l of block b is at
+// (b * NumInfluences + k) * SAMPLER_LANES + l.
+struct SkinInfluences
+{
+	unsigned int NumInfluences;
+	vector<unsigned int> BoneIDs;
+	vector<float> Weights;
+
+	SkinInfluences()
+	{
+		NumInfluences = 0;
+	}
+};
+
+// A mesh's vertices laid out for the CPU skinning kernels. Vertices come in
+// blocks of SAMPLER_LANES; component c of lane l of block b is at
+// (b * SKINNING_REST_COMPONENTS + c) * SAMPLER_LANES + l, so a block is one
+// contiguous run for every ISA. Padding lanes are bound fully to bone 0 so
+// they stay finite, and are never written out.
+struct SkinningStream
+{
+	unsigned int NumVertices;
+	unsigned int NumBlocks;
+	vector<float> Rest;
+	// One per skeletal LOD, as Mesh::vertexBoneData then Mesh::lodBoneData.
+	vector<SkinInfluences> Influences;
+
+	SkinningStream()
+	{
+		NumVertices = 0;
+		NumBlocks = 0;
+	}
+
+	void Build(const Mesh& mesh)
+	{
+		NumVertices = (unsigned int)mesh.vertices.size();
+		NumBlocks = (NumVertices + SAMPLER_LANES - 1) / SAMPLER_LANES;
+		Rest.assign(NumBlocks * SKINNING_REST_COMPONENTS * SAMPLER_LANES, 0.0f);
+		for(unsigned int v = 0; v < NumVertices; v++)
+		{
+			const Vertex& vertex = mesh.vertices[v];
+			float* pBlock = &Rest[v / SAMPLER_LANES * SKINNING_REST_COMPONENTS * SAMPLER_LANES + v % SAMPLER_LANES];
+			for(unsigned int c = 0; c < 3; c++)
+			{
+				pBlock[c * SAMPLER_LANES] = vertex.Position[c];
+				pBlock[(3 + c) * SAMPLER_LANES] = vertex.Normal[c];
+			}
+		}
+
+		Influences.resize(mesh.lodBoneData.size() + 1);
+		for(unsigned int l = 0; l < Influences.size(); l++)
+			addInfluences(mesh.BoneData(l), Influences[l]);
+	}
+
+private:
+	// The stream's width is always a kernel's width: 2, 4 or 8.
+	void addInfluences(const BoneStream& boneData, SkinInfluences& Out) const
+	{
+		unsigned int Count = boneData.NumInfluences;
+		unsigned int Size = NumBlocks * Count * SAMPLER_LANES;
+		Out.NumInfluences = Count;
+		Out.BoneIDs.assign(Size, 0);
+		Out.Weights.assign(Size, 0.0f);
+		for(unsigned int v = 0; v < NumBlocks * SAMPLER_LANES; v++)
+		{
+			unsigned int Base = v / SAMPLER_LANES * Count * SAMPLER_LANES + v % SAMPLER_LANES;
+			if(v >= NumVertices || v >= boneData.Size())
+			{
+				Out.Weights[Base] = 1.0f;
+				continue;
+			}
+			for(unsigned int k = 0; k < Count; k++)
+			{
+				Out.BoneIDs[Base + k * SAMPLER_LANES] = boneData.BoneID(v, k);
+				Out.Weights[Base + k * SAMPLER_LANES] = boneData.Weight(v, k);
+			}
+		}
+	}
+};
+
+// Skinned positions and normals of one mesh, one per vertex.
+struct SkinnedVertices
+{
+	vector<vec3> Positions;
+	vector<vec3> Normals;
+};
+
+// a with its sign flipped in the lanes where b is negative (sign bit set),
+// for aligning dual quaternions to the first influence's hemisphere.
+inline Lanes1 FlipSign(const Lanes1& a, const Lanes1& b) { return Lanes1::Set(signbit(b.v) ? -a.v : a.v); }
+
+#ifdef SAMPLER_SSE
+inline Lanes4 FlipSign(const Lanes4& a, const Lanes4& b)
+{
+	return Lanes4::Make(_mm_xor_ps(a.v, _mm_and_ps(b.v, _mm_set1_ps(-0.0f))));
+}
+#endif
+
+#ifdef SAMPLER_AVX
+SAMPLER_AVX_TARGET inline Lanes8 FlipSign(const Lanes8& a, const Lanes8& b)
+{
+	return Lanes8::Make(_mm256_xor_ps(a.v, _mm256_and_ps(b.v, _mm256_set1_ps(-0.0f))));
+}
+#endif
+
+// Skins blocks [BeginBlock, EndBlock) of Stream with one of its bone
+// streams and the palette in Mode's layout (see BonePalette::Data). LBS and
+// affine palettes blend the bone matrices as shaders/skinning.vs does and
+// renormalize the normal; DQ palettes blend dual quaternions as its
+// DQ_OPTIMISED variant does. N is the bone stream's
+// NumInfluences, so the blends unroll. Vertex v is written to pPositions[v]
+// and pNormals[v].
+template<typename V, unsigned int N>
+HIERARCHY_INLINE void SkinBlocks(const SkinningStream& Stream, const SkinInfluences& Influences, SkinningMode Mode, const float* pPalette,
+	unsigned int BeginBlock, unsigned int EndBlock, vec3* pPositions, vec3* pNormals)
+{
+	// Where row r, column c of a bone's matrix sits in the palette.
+	unsigned int Stride = Mode == SKINNING_DQ ? HIERARCHY_DQ_COMPONENTS : Mode == SKINNING_AFFINE ? HIERARCHY_AFFINE_COMPONENTS : 16;
+	unsigned int RowStep = Mode == SKINNING_AFFINE ? 4 : 1;
+	unsigned int ColumnStep = Mode == SKINNING_AFFINE ? 1 : 4;
+
+	unsigned int Offsets[N][V::Width];
+	float Out[SKINNING_REST_COMPONENTS][V::Width];
+
+	for(unsigned int b = BeginBlock; b < EndBlock; b++)
+		for(unsigned int Half = 0; Half < SAMPLER_LANES; Half += V::Width)
+		{
+			const float* pRest = &Stream.Rest[b * SKINNING_REST_COMPONENTS * SAMPLER_LANES + Half];
+			const unsigned int* pBones = &Influences.BoneIDs[b * N * SAMPLER_LANES + Half];
+			const float* pWeights = &Influences.Weights[b * N * SAMPLER_LANES + Half];
+			for(unsigned int k = 0; k < N; k++)
+				for(unsigned int l = 0; l < (unsigned int)V::Width; l++)
+					Offsets[k][l] = pBones[k * SAMPLER_LANES + l] * Stride;
+
+			V px = V::Load(pRest), py = V::Load(pRest + SAMPLER_LANES), pz = V::Load(pRest + 2 * SAMPLER_LANES);
+			V nx = V::Load(pRest + 3 * SAMPLER_LANES), ny = V::Load(pRest + 4 * SAMPLER_LANES), nz = V::Load(pRest + 5 * SAMPLER_LANES);
+			V Two = V::Set(2.0f);
+
+			if(Mode == SKINNING_DQ)
+			{
+				DualQuatLanes<V> First = GatherDQLanes<V>(pPalette, 1, Offsets[0]);
+				V w = V::Load(pWeights);
+				DualQuatLanes<V> q;
+				q.rx = First.rx * w; q.ry = First.ry * w; q.rz = First.rz * w; q.rw = First.rw * w;
+				q.dx = First.dx * w; q.dy = First.dy * w; q.dz = First.dz * w; q.dw = First.dw * w;
+				for(unsigned int k = 1; k < N; k++)
+				{
+					DualQuatLanes<V> d = GatherDQLanes<V>(pPalette, 1, Offsets[k]);
+					V Dot = First.rx * d.rx + First.ry * d.ry + First.rz * d.rz + First.rw * d.rw;
+					V wk = FlipSign(V::Load(pWeights + k * SAMPLER_LANES), Dot);
+					q.rx = q.rx + d.rx * wk; q.ry = q.ry + d.ry * wk; q.rz = q.rz + d.rz * wk; q.rw = q.rw + d.rw * wk;
+					q.dx = q.dx + d.dx * wk; q.dy = q.dy + d.dy * wk; q.dz = q.dz + d.dz * wk; q.dw = q.dw + d.dw * wk;
+				}
+
+				V Length = Sqrt(q.rx * q.rx + q.ry * q.ry + q.rz * q.rz + q.rw * q.rw);
+				q.rx = q.rx / Length; q.ry = q.ry / Length; q.rz = q.rz / Length; q.rw = q.rw / Length;
+				q.dx = q.dx / Length; q.dy = q.dy / Length; q.dz = q.dz / Length; q.dw = q.dw / Length;
+
+				// p + 2 r x (r x p + w p), plus 2 (w d - d.w r + r x d).
+				V ax = q.ry * pz - q.rz * py + q.rw * px;
+				V ay = q.rz * px - q.rx * pz + q.rw * py;
+				V az = q.rx * py - q.ry * px + q.rw * pz;
+				V tx = Two * (q.rw * q.dx - q.dw * q.rx + (q.ry * q.dz - q.rz * q.dy));
+				V ty = Two * (q.rw * q.dy - q.dw * q.ry + (q.rz * q.dx - q.rx * q.dz));
+				V tz = Two * (q.rw * q.dz - q.dw * q.rz + (q.rx * q.dy - q.ry * q.dx));
+				(px + Two * (q.ry * az - q.rz * ay) + tx).Store(Out[0]);
+				(py + Two * (q.rz * ax - q.rx * az) + ty).Store(Out[1]);
+				(pz + Two * (q.rx * ay - q.ry * ax) + tz).Store(Out[2]);
+
+				V bx = q.ry * nz - q.rz * ny + q.rw * nx;
+				V by = q.rz * nx - q.rx * nz + q.rw * ny;
+				V bz = q.rx * ny - q.ry * nx + q.rw * nz;
+				(nx + Two * (q.ry * bz - q.rz * by)).Store(Out[3]);
+				(ny + Two * (q.rz * bx - q.rx * bz)).Store(Out[4]);
+				(nz + Two * (q.rx * by - q.ry * bx)).Store(Out[5]);
+			}
+			else
+			{
+				// Blended top three rows, row by row.
+				AffineLanes<V> m;
+				V w = V::Load(pWeights);
+				for(unsigned int r = 0; r < 3; r++)
+					for(unsigned int c = 0; c < 4; c++)
+						m.m[r * 4 + c] = V::Gather(pPalette + r * RowStep + c * ColumnStep, Offsets[0]) * w;
+				for(unsigned int k = 1; k < N; k++)
+				{
+					V wk = V::Load(pWeights + k * SAMPLER_LANES);
+					for(unsigned int r = 0; r < 3; r++)
+						for(unsigned int c = 0; c < 4; c++)
+							m.m[r * 4 + c] = m.m[r * 4 + c] + V::Gather(pPalette + r * RowStep + c * ColumnStep, Offsets[k]) * wk;
+				}
+
+				V Normal[3];
+				for(unsigned int r = 0; r < 3; r++)
+				{
+					(m.m[r * 4] * px + m.m[r * 4 + 1] * py + m.m[r * 4 + 2] * pz + m.m[r * 4 + 3]).Store(Out[r]);
+					Normal[r] = m.m[r * 4] * nx + m.m[r * 4 + 1] * ny + m.m[r * 4 + 2] * nz;
+				}
+				V Length = Sqrt(Normal[0] * Normal[0] + Normal[1] * Normal[1] + Normal[2] * Normal[2]);
+				for(unsigned int r = 0; r < 3; r++)
+					(Normal[r] / Length).Store(Out[3 + r]);
+			}
+
+			unsigned int First = b * SAMPLER_LANES + Half;
+			unsigned int Lanes = First >= Stream.NumVertices ? 0 : min((unsigned int)V::Width, Stream.NumVertices - First);
+			for(unsigned int l = 0; l < Lanes; l++)
+			{
+				pPositions[First + l] = vec3(Out[0][l], Out[1][l], Out[2][l]);
+				pNormals[First + l] = vec3(Out[3][l], Out[4][l], Out[5][l]);
+			}
+		}
+}
+
+// Every ISA does the same operations in the same order, so the scalar
+// kernel is a bit-exact reference for the others.
+typedef void (*SkinningKernel)(const SkinningStream& Stream, const SkinInfluences& Influences, SkinningMode Mode, const float* pPalette,
+	unsigned int BeginBlock, unsigned int EndBlock, vec3* pPositions, vec3* pNormals);
+
+template<unsigned int N>
+inline void SkinBlocksScalar(const SkinningStream& Stream, const SkinInfluences& Influences, SkinningMode Mode, const float* pPalette,
+	unsigned int BeginBlock, unsigned int EndBlock, vec3* pPositions, vec3* pNormals)
+{
+	SkinBlocks<Lanes1, N>(Stream, Influences, Mode, pPalette, BeginBlock, EndBlock, pPositions, pNormals);
+}
+
+#ifdef SAMPLER_SSE
+template<unsigned int N>
+inline void SkinBlocksSSE(const SkinningStream& Stream, const SkinInfluences& Influences, SkinningMode Mode, const float* pPalette,
+	unsigned int BeginBlock, unsigned int EndBlock, vec3* pPositions, vec3* pNormals)
+{
+	SkinBlocks<Lanes4, N>(Stream, Influences, Mode, pPalette, BeginBlock, EndBlock, pPositions, pNormals);
+}
+#endif
+
+#ifdef SAMPLER_AVX
+template<unsigned int N>
+SAMPLER_AVX_TARGET inline void SkinBlocksAVX(const SkinningStream& Stream, const SkinInfluences& Influences, SkinningMode Mode, const float* pPalette,
+	unsigned int BeginBlock, unsigned int EndBlock, vec3* pPositions, vec3* pNormals)
+{
+	SkinBlocks<Lanes8, N>(Stream, Influences, Mode, pPalette, BeginBlock, EndBlock, pPositions, pNormals);
+}
+#endif
+
+template<unsigned int N>
+inline SkinningKernel SelectSkinningKernel(SamplerISA ISA)
+{
+#ifdef SAMPLER_AVX
+	if(ISA == SAMPLER_ISA_AVX)
+		return SkinBlocksAVX<N>;
+#endif
+#ifdef SAMPLER_SSE
+	if(ISA != SAMPLER_ISA_SCALAR)
+		return SkinBlocksSSE<N>;
+#endif
+	return SkinBlocksScalar<N>;
+}
+
+// The kernel for ISA and bone streams of NumInfluences (2, 4 or 8).
+inline SkinningKernel SelectSkinningKernel(SamplerISA ISA, unsigned int NumInfluences)
+{
+	if(NumInfluences <= 2)
+		return SelectSkinningKernel<2>(ISA);
+	if(NumInfluences <= 4)
+		return SelectSkinningKernel<4>(ISA);
+	return SelectSkinningKernel<8>(ISA);
+}
+
+// Skins a whole mesh with bone stream LOD, splitting its blocks across
+// Pool. The kernel is ISA's for the stream's influence count. Needs no GL
+// context.
+inline void SkinMesh(WorkerPool& Pool, SamplerISA ISA, const SkinningStream& Stream, unsigned int LOD, const BonePalette& Palette, SkinnedVertices& Out)
+{
+	Out.Positions.resize(Stream.NumVertices);
+	Out.Normals.resize(Stream.NumVertices);
+	if(Stream.NumVertices == 0 || Palette.Size() == 0)
+		return;
+
+	const SkinInfluences& Influences = Stream.Influences[LOD < Stream.Influences.size() ? LOD : Stream.Influences.size() - 1];
+	SkinningKernel Kernel = SelectSkinningKernel(ISA, Influences.NumInfluences);
+	const float* pPalette = Palette.Data();
+	vec3* pPositions = &Out.Positions[0];
+	vec3* pNormals = &Out.Normals[0];
+	Pool.ParallelFor(Stream.NumBlocks, SKINNING_GRAIN, [&](unsigned int Begin, unsigned int End)
+	{
+		Kernel(Stream, Influences, Palette.Mode, pPalette, Begin, End, pPositions, pNormals);
+	});
+}
+#endif
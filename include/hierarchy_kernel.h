@@ -0,0 +1,646 @@
+#ifndef HIERARCHY_KERNEL_H
+#define HIERARCHY_KERNEL_H
+
+#include <glm/glm.hpp>
+#include <glm\gtx\dual_quaternion.hpp>
+
+#include "mesh.h"
+#include "skeleton.h"
+#include "skinning.h"
+#include "rotation_sampler.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+using namespace std;
+using namespace glm;
+
+// The kernel body is written once against a lane type and inlined into each
+// ISA's entry point, so the AVX instantiation is compiled for AVX.
+#if defined(_MSC_VER)
+#define HIERARCHY_INLINE __forceinline
+#else
+#define HIERARCHY_INLINE inline __attribute__((always_inline))
+#endif
+
+// Components per lane of HierarchyStream's SoA arrays: a dual quaternion is
+// real x, y, z, w then dual x, y, z, w; an affine transform is the top three
+// rows of the matrix, row by row.
+#define HIERARCHY_DQ_COMPONENTS 8
+#define HIERARCHY_AFFINE_COMPONENTS 12
+// Local rotation x, y, z, w then translation x, y, z.
+#define HIERARCHY_LOCAL_COMPONENTS 7
+
+// The dynamic joints of one skeletal LOD laid out for the hierarchy kernel.
+// Lanes come in blocks of SAMPLER_LANES: first the external parents (lane 0
+// is the identity, lane 1 the global inverse, then static joints that have
+// dynamic children), then the dynamic joints grouped by depth, each depth
+// padded to a whole block. A block therefore never holds a joint and its
+// parent, and every parent is finished before the block that reads it.
+struct HierarchyStream
+{
+	unsigned int NumLanes;
+	unsigned int NumLevels;
+	// First lane of the dynamic joints; lanes before it are external parents.
+	unsigned int FirstJointLane;
+	// Joint of each lane, INVALID_JOINT for padding and the two constants.
+	vector<int> Joints;
+	vector<unsigned int> Parents;
+	// ~0 where the joint has a channel; elsewhere the affine kernel uses
+	// ConstantLocals and the DQ kernel ConstantRigid, the joint's
+	// LocalRotation and LocalTranslation, as the per-joint path does.
+	vector<unsigned int> ChannelMasks;
+	vector<float> ConstantLocals;
+	vector<float> ConstantRigid;
+
+	// Lanes that are bones, padded to a whole block, with the palette entry
+	// they write (INVALID_JOINT for padding) and their offsets.
+	unsigned int NumBoneLanes;
+	vector<unsigned int> BoneLanes;
+	vector<int> Bones;
+	vector<float> OffsetsDQ;
+	vector<float> OffsetsAffine;
+
+	HierarchyStream()
+	{
+		NumLanes = 0;
+		NumLevels = 0;
+		FirstJointLane = 0;
+		NumBoneLanes = 0;
+	}
+
+	void Build(const Skeleton& skeleton, const SkeletonLOD& LOD, const vector<BoneInfo>& boneInfo)
+	{
+		unsigned int Count = skeleton.NumJoints();
+		vector<int> Lane(Count, -1);
+		vector<unsigned int> Depth(Count, 0);
+		for(unsigned int i = 0; i < Count; i++)
+			if(skeleton.Joints[i].Parent != INVALID_JOINT)
+				Depth[i] = Depth[skeleton.Joints[i].Parent] + 1;
+
+		Joints.assign(2, INVALID_JOINT);
+		for(unsigned int i = 0; i < LOD.DynamicJoints.size(); i++)
+		{
+			int Parent = skeleton.Joints[LOD.DynamicJoints[i]].Parent;
+			if(Parent != INVALID_JOINT && !skeleton.Joints[Parent].Dynamic && Lane[Parent] < 0)
+			{
+				Lane[Parent] = (int)Joints.size();
+				Joints.push_back(Parent);
+			}
+		}
+		pad(Joints);
+		FirstJointLane = (unsigned int)Joints.size();
+
+		unsigned int MaxDepth = 0;
+		for(unsigned int i = 0; i < LOD.DynamicJoints.size(); i++)
+			MaxDepth = Depth[LOD.DynamicJoints[i]] > MaxDepth ? Depth[LOD.DynamicJoints[i]] : MaxDepth;
+
+		NumLevels = 0;
+		for(unsigned int d = 0; d <= MaxDepth && !LOD.DynamicJoints.empty(); d++)
+		{
+			unsigned int Begin = (unsigned int)Joints.size();
+			for(unsigned int i = 0; i < LOD.DynamicJoints.size(); i++)
+				if(Depth[LOD.DynamicJoints[i]] == d)
+				{
+					Lane[LOD.DynamicJoints[i]] = (int)Joints.size();
+					Joints.push_back(LOD.DynamicJoints[i]);
+				}
+			if(Joints.size() > Begin)
+				NumLevels++;
+			pad(Joints);
+		}
+		NumLanes = (unsigned int)Joints.size();
+
+		Parents.assign(NumLanes, 0);
+		ChannelMasks.assign(NumLanes, 0);
+		ConstantLocals.assign(HIERARCHY_AFFINE_COMPONENTS * NumLanes, 0.0f);
+		ConstantRigid.assign(HIERARCHY_LOCAL_COMPONENTS * NumLanes, 0.0f);
+		for(unsigned int l = FirstJointLane; l < NumLanes; l++)
+		{
+			storeAffine(mat4(1.0f), &ConstantLocals[0], NumLanes, l);
+			ConstantRigid[3 * NumLanes + l] = 1.0f;
+			if(Joints[l] == INVALID_JOINT)
+				continue;
+
+			const Joint& joint = skeleton.Joints[Joints[l]];
+			if(joint.Channel != INVALID_CHANNEL)
+				ChannelMasks[l] = ~0u;
+			else
+			{
+				storeAffine(joint.LocalTransformation, &ConstantLocals[0], NumLanes, l);
+				ConstantRigid[0 * NumLanes + l] = joint.LocalRotation.x;
+				ConstantRigid[1 * NumLanes + l] = joint.LocalRotation.y;
+				ConstantRigid[2 * NumLanes + l] = joint.LocalRotation.z;
+				ConstantRigid[3 * NumLanes + l] = joint.LocalRotation.w;
+				ConstantRigid[4 * NumLanes + l] = joint.LocalTranslation.x;
+				ConstantRigid[5 * NumLanes + l] = joint.LocalTranslation.y;
+				ConstantRigid[6 * NumLanes + l] = joint.LocalTranslation.z;
+			}
+
+			// Roots hang off the identity, or the global inverse when animated.
+			if(joint.Parent == INVALID_JOINT)
+				Parents[l] = joint.Channel != INVALID_CHANNEL ? 1 : 0;
+			else
+				Parents[l] = (unsigned int)Lane[joint.Parent];
+		}
+
+		BoneLanes.clear();
+		Bones.clear();
+		for(unsigned int l = FirstJointLane; l < NumLanes; l++)
+			if(Joints[l] != INVALID_JOINT && skeleton.Joints[Joints[l]].BoneIndex != INVALID_JOINT)
+			{
+				BoneLanes.push_back(l);
+				Bones.push_back(skeleton.Joints[Joints[l]].BoneIndex);
+			}
+		while(BoneLanes.size() % SAMPLER_LANES != 0)
+		{
+			BoneLanes.push_back(0);
+			Bones.push_back(INVALID_JOINT);
+		}
+		NumBoneLanes = (unsigned int)BoneLanes.size();
+
+		OffsetsDQ.assign(HIERARCHY_DQ_COMPONENTS * NumBoneLanes, 0.0f);
+		OffsetsAffine.assign(HIERARCHY_AFFINE_COMPONENTS * NumBoneLanes, 0.0f);
+		for(unsigned int b = 0; b < NumBoneLanes; b++)
+		{
+			if(Bones[b] == INVALID_JOINT)
+			{
+				storeDQ(fdualquat(quat(1.f, 0.f, 0.f, 0.f), quat(0.f, 0.f, 0.f, 0.f)), &OffsetsDQ[0], NumBoneLanes, b);
+				storeAffine(mat4(1.0f), &OffsetsAffine[0], NumBoneLanes, b);
+				continue;
+			}
+			storeDQ(boneInfo[Bones[b]].offsetDQ, &OffsetsDQ[0], NumBoneLanes, b);
+			storeAffine(boneInfo[Bones[b]].offset, &OffsetsAffine[0], NumBoneLanes, b);
+		}
+	}
+
+	// Writes the external lanes of pGlobal for Mode: the two constants and
+	// the current global transforms of the static parents.
+	void LoadParents(SkinningMode Mode, const mat4& GlobalInverse, const fdualquat& InverseDQ, const vector<fdualquat>& GlobalsDQ, const vector<mat4>& Globals, float* pGlobal) const
+	{
+		for(unsigned int l = 0; l < FirstJointLane; l++)
+		{
+			if(Mode == SKINNING_DQ)
+			{
+				fdualquat Value = fdualquat(quat(1.f, 0.f, 0.f, 0.f), quat(0.f, 0.f, 0.f, 0.f));
+				if(l == 1)
+					Value = InverseDQ;
+				else if(Joints[l] != INVALID_JOINT)
+					Value = GlobalsDQ[Joints[l]];
+				storeDQ(Value, pGlobal, NumLanes, l);
+			}
+			else
+			{
+				mat4 Value = mat4(1.0f);
+				if(l == 1)
+					Value = GlobalInverse;
+				else if(Joints[l] != INVALID_JOINT)
+					Value = Globals[Joints[l]];
+				storeAffine(Value, pGlobal, NumLanes, l);
+			}
+		}
+	}
+
+	// Writes the joints' local rotations and translations into pLocal in lane
+	// order; lanes without a channel get ConstantRigid.
+	void LoadLocals(const vector<fquat>& Rotations, const vector<vec3>& Translations, float* pLocal) const
+	{
+		for(unsigned int l = FirstJointLane; l < NumLanes; l++)
+		{
+			if(ChannelMasks[l] == 0)
+			{
+				for(unsigned int i = 0; i < HIERARCHY_LOCAL_COMPONENTS; i++)
+					pLocal[i * NumLanes + l] = ConstantRigid[i * NumLanes + l];
+				continue;
+			}
+			const fquat& Rotation = Rotations[Joints[l]];
+			const vec3& Translation = Translations[Joints[l]];
+			pLocal[0 * NumLanes + l] = Rotation.x;
+			pLocal[1 * NumLanes + l] = Rotation.y;
+			pLocal[2 * NumLanes + l] = Rotation.z;
+			pLocal[3 * NumLanes + l] = Rotation.w;
+			pLocal[4 * NumLanes + l] = Translation.x;
+			pLocal[5 * NumLanes + l] = Translation.y;
+			pLocal[6 * NumLanes + l] = Translation.z;
+		}
+	}
+
+private:
+	static void pad(vector<int>& Lanes)
+	{
+		while(Lanes.size() % SAMPLER_LANES != 0)
+			Lanes.push_back(INVALID_JOINT);
+	}
+
+	static void storeDQ(const fdualquat& Value, float* p, unsigned int Stride, unsigned int Lane)
+	{
+		p[0 * Stride + Lane] = Value.real.x;
+		p[1 * Stride + Lane] = Value.real.y;
+		p[2 * Stride + Lane] = Value.real.z;
+		p[3 * Stride + Lane] = Value.real.w;
+		p[4 * Stride + Lane] = Value.dual.x;
+		p[5 * Stride + Lane] = Value.dual.y;
+		p[6 * Stride + Lane] = Value.dual.z;
+		p[7 * Stride + Lane] = Value.dual.w;
+	}
+
+	static void storeAffine(const mat4& Value, float* p, unsigned int Stride, unsigned int Lane)
+	{
+		for(unsigned int r = 0; r < 3; r++)
+			for(unsigned int c = 0; c < 4; c++)
+				p[(r * 4 + c) * Stride + Lane] = Value[c][r];
+	}
+};
+
+// Lane types the kernel is written against: one float, an SSE register and
+// an AVX register. They only wrap the operations the kernel needs.
+struct Lanes1
+{
+	enum { Width = 1 };
+	float v;
+
+	static Lanes1 Load(const float* p) { Lanes1 r; r.v = *p; return r; }
+	static Lanes1 Set(float x) { Lanes1 r; r.v = x; return r; }
+	static Lanes1 Gather(const float* p, const unsigned int* pIndices) { return Set(p[pIndices[0]]); }
+	// Mask ? a : b per lane, Mask being ~0 or 0.
+	static Lanes1 Select(const unsigned int* pMask, const Lanes1& a, const Lanes1& b) { return *pMask ? a : b; }
+	void Store(float* p) const { *p = v; }
+};
+
+inline Lanes1 operator+(const Lanes1& a, const Lanes1& b) { return Lanes1::Set(a.v + b.v); }
+inline Lanes1 operator-(const Lanes1& a, const Lanes1& b) { return Lanes1::Set(a.v - b.v); }
+inline Lanes1 operator*(const Lanes1& a, const Lanes1& b) { return Lanes1::Set(a.v * b.v); }
+inline Lanes1 operator/(const Lanes1& a, const Lanes1& b) { return Lanes1::Set(a.v / b.v); }
+inline Lanes1 Sqrt(const Lanes1& a) { return Lanes1::Set(sqrt(a.v)); }
+
+#ifdef SAMPLER_SSE
+struct Lanes4
+{
+	enum { Width = 4 };
+	__m128 v;
+
+	static Lanes4 Make(__m128 x) { Lanes4 r; r.v = x; return r; }
+	static Lanes4 Load(const float* p) { return Make(_mm_loadu_ps(p)); }
+	static Lanes4 Set(float x) { return Make(_mm_set1_ps(x)); }
+	static Lanes4 Gather(const float* p, const unsigned int* pIndices)
+	{
+		return Make(_mm_set_ps(p[pIndices[3]], p[pIndices[2]], p[pIndices[1]], p[pIndices[0]]));
+	}
+	static Lanes4 Select(const unsigned int* pMask, const Lanes4& a, const Lanes4& b)
+	{
+		__m128 Mask = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)pMask));
+		return Make(_mm_or_ps(_mm_and_ps(Mask, a.v), _mm_andnot_ps(Mask, b.v)));
+	}
+	void Store(float* p) const { _mm_storeu_ps(p, v); }
+};
+
+inline Lanes4 operator+(const Lanes4& a, const Lanes4& b) { return Lanes4::Make(_mm_add_ps(a.v, b.v)); }
+inline Lanes4 operator-(const Lanes4& a, const Lanes4& b) { return Lanes4::Make(_mm_sub_ps(a.v, b.v)); }
+inline Lanes4 operator*(const Lanes4& a, const Lanes4& b) { return Lanes4::Make(_mm_mul_ps(a.v, b.v)); }
+inline Lanes4 operator/(const Lanes4& a, const Lanes4& b) { return Lanes4::Make(_mm_div_ps(a.v, b.v)); }
+inline Lanes4 Sqrt(const Lanes4& a) { return Lanes4::Make(_mm_sqrt_ps(a.v)); }
+#endif
+
+#ifdef SAMPLER_AVX
+struct Lanes8
+{
+	enum { Width = 8 };
+	__m256 v;
+
+	SAMPLER_AVX_TARGET static Lanes8 Make(__m256 x) { Lanes8 r; r.v = x; return r; }
+	SAMPLER_AVX_TARGET static Lanes8 Load(const float* p) { return Make(_mm256_loadu_ps(p)); }
+	SAMPLER_AVX_TARGET static Lanes8 Set(float x) { return Make(_mm256_set1_ps(x)); }
+	SAMPLER_AVX_TARGET static Lanes8 Gather(const float* p, const unsigned int* pIndices)
+	{
+		return Make(_mm256_set_ps(p[pIndices[7]], p[pIndices[6]], p[pIndices[5]], p[pIndices[4]], p[pIndices[3]], p[pIndices[2]], p[pIndices[1]], p[pIndices[0]]));
+	}
+	SAMPLER_AVX_TARGET static Lanes8 Select(const unsigned int* pMask, const Lanes8& a, const Lanes8& b)
+	{
+		__m256 Mask = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)pMask));
+		return Make(_mm256_blendv_ps(b.v, a.v, Mask));
+	}
+	SAMPLER_AVX_TARGET void Store(float* p) const { _mm256_storeu_ps(p, v); }
+};
+
+SAMPLER_AVX_TARGET inline Lanes8 operator+(const Lanes8& a, const Lanes8& b) { return Lanes8::Make(_mm256_add_ps(a.v, b.v)); }
+SAMPLER_AVX_TARGET inline Lanes8 operator-(const Lanes8& a, const Lanes8& b) { return Lanes8::Make(_mm256_sub_ps(a.v, b.v)); }
+SAMPLER_AVX_TARGET inline Lanes8 operator*(const Lanes8& a, const Lanes8& b) { return Lanes8::Make(_mm256_mul_ps(a.v, b.v)); }
+SAMPLER_AVX_TARGET inline Lanes8 operator/(const Lanes8& a, const Lanes8& b) { return Lanes8::Make(_mm256_div_ps(a.v, b.v)); }
+SAMPLER_AVX_TARGET inline Lanes8 Sqrt(const Lanes8& a) { return Lanes8::Make(_mm256_sqrt_ps(a.v)); }
+#endif
+
+template<typename V>
+struct DualQuatLanes
+{
+	V rx, ry, rz, rw, dx, dy, dz, dw;
+};
+
+template<typename V>
+struct AffineLanes
+{
+	V m[HIERARCHY_AFFINE_COMPONENTS];
+};
+
+template<typename V>
+HIERARCHY_INLINE DualQuatLanes<V> LoadDQLanes(const float* p, unsigned int Stride)
+{
+	DualQuatLanes<V> q;
+	q.rx = V::Load(p);
+	q.ry = V::Load(p + Stride);
+	q.rz = V::Load(p + 2 * Stride);
+	q.rw = V::Load(p + 3 * Stride);
+	q.dx = V::Load(p + 4 * Stride);
+	q.dy = V::Load(p + 5 * Stride);
+	q.dz = V::Load(p + 6 * Stride);
+	q.dw = V::Load(p + 7 * Stride);
+	return q;
+}
+
+template<typename V>
+HIERARCHY_INLINE DualQuatLanes<V> GatherDQLanes(const float* p, unsigned int Stride, const unsigned int* pIndices)
+{
+	DualQuatLanes<V> q;
+	q.rx = V::Gather(p, pIndices);
+	q.ry = V::Gather(p + Stride, pIndices);
+	q.rz = V::Gather(p + 2 * Stride, pIndices);
+	q.rw = V::Gather(p + 3 * Stride, pIndices);
+	q.dx = V::Gather(p + 4 * Stride, pIndices);
+	q.dy = V::Gather(p + 5 * Stride, pIndices);
+	q.dz = V::Gather(p + 6 * Stride, pIndices);
+	q.dw = V::Gather(p + 7 * Stride, pIndices);
+	return q;
+}
+
+template<typename V>
+HIERARCHY_INLINE void StoreDQLanes(const DualQuatLanes<V>& q, float* p, unsigned int Stride)
+{
+	q.rx.Store(p);
+	q.ry.Store(p + Stride);
+	q.rz.Store(p + 2 * Stride);
+	q.rw.Store(p + 3 * Stride);
+	q.dx.Store(p + 4 * Stride);
+	q.dy.Store(p + 5 * Stride);
+	q.dz.Store(p + 6 * Stride);
+	q.dw.Store(p + 7 * Stride);
+}
+
+// a * b, as glm's dual quaternion product.
+template<typename V>
+HIERARCHY_INLINE DualQuatLanes<V> MulDQLanes(const DualQuatLanes<V>& a, const DualQuatLanes<V>& b)
+{
+	DualQuatLanes<V> r;
+	r.rw = a.rw * b.rw - a.rx * b.rx - a.ry * b.ry - a.rz * b.rz;
+	r.rx = a.rw * b.rx + a.rx * b.rw + a.ry * b.rz - a.rz * b.ry;
+	r.ry = a.rw * b.ry + a.ry * b.rw + a.rz * b.rx - a.rx * b.rz;
+	r.rz = a.rw * b.rz + a.rz * b.rw + a.rx * b.ry - a.ry * b.rx;
+	r.dw = (a.rw * b.dw - a.rx * b.dx - a.ry * b.dy - a.rz * b.dz) + (a.dw * b.rw - a.dx * b.rx - a.dy * b.ry - a.dz * b.rz);
+	r.dx = (a.rw * b.dx + a.rx * b.dw + a.ry * b.dz - a.rz * b.dy) + (a.dw * b.rx + a.dx * b.rw + a.dy * b.rz - a.dz * b.ry);
+	r.dy = (a.rw * b.dy + a.ry * b.dw + a.rz * b.dx - a.rx * b.dz) + (a.dw * b.ry + a.dy * b.rw + a.dz * b.rx - a.dx * b.rz);
+	r.dz = (a.rw * b.dz + a.rz * b.dw + a.rx * b.dy - a.ry * b.dx) + (a.dw * b.rz + a.dz * b.rw + a.dx * b.ry - a.dy * b.rx);
+	return r;
+}
+
+// Divides by the length of the real part, and turns a -0 dual w into +0 the
+// way the per-joint path does.
+template<typename V>
+HIERARCHY_INLINE void NormalizeDQLanes(DualQuatLanes<V>& q)
+{
+	V Length = Sqrt(q.rx * q.rx + q.ry * q.ry + q.rz * q.rz + q.rw * q.rw);
+	q.rx = q.rx / Length;
+	q.ry = q.ry / Length;
+	q.rz = q.rz / Length;
+	q.rw = q.rw / Length;
+	q.dx = q.dx / Length;
+	q.dy = q.dy / Length;
+	q.dz = q.dz / Length;
+	q.dw = q.dw / Length + V::Set(0.0f);
+}
+
+template<typename V>
+HIERARCHY_INLINE AffineLanes<V> GatherAffineLanes(const float* p, unsigned int Stride, const unsigned int* pIndices)
+{
+	AffineLanes<V> a;
+	for(unsigned int i = 0; i < HIERARCHY_AFFINE_COMPONENTS; i++)
+		a.m[i] = V::Gather(p + i * Stride, pIndices);
+	return a;
+}
+
+template<typename V>
+HIERARCHY_INLINE AffineLanes<V> LoadAffineLanes(const float* p, unsigned int Stride)
+{
+	AffineLanes<V> a;
+	for(unsigned int i = 0; i < HIERARCHY_AFFINE_COMPONENTS; i++)
+		a.m[i] = V::Load(p + i * Stride);
+	return a;
+}
+
+template<typename V>
+HIERARCHY_INLINE AffineLanes<V> MulAffineLanes(const AffineLanes<V>& a, const AffineLanes<V>& b)
+{
+	AffineLanes<V> r;
+	for(unsigned int Row = 0; Row < 3; Row++)
+	{
+		const V* pa = &a.m[Row * 4];
+		for(unsigned int Col = 0; Col < 3; Col++)
+			r.m[Row * 4 + Col] = pa[0] * b.m[Col] + pa[1] * b.m[4 + Col] + pa[2] * b.m[8 + Col];
+		r.m[Row * 4 + 3] = pa[0] * b.m[3] + pa[1] * b.m[7] + pa[2] * b.m[11] + pa[3];
+	}
+	return r;
+}
+
+// Global transforms of the dynamic joints, parent-first: local from the
+// SoA rotations and translations, times the parent's global.
+template<typename V>
+HIERARCHY_INLINE void EvaluateLevels(const HierarchyStream& Stream, SkinningMode Mode, const float* pLocal, float* pGlobal)
+{
+	unsigned int N = Stream.NumLanes;
+	V MinusHalf = V::Set(-0.5f);
+	V One = V::Set(1.0f);
+	V Two = V::Set(2.0f);
+	V Half = V::Set(0.5f);
+
+	for(unsigned int l = Stream.FirstJointLane; l < N; l += V::Width)
+	{
+		V qx = V::Load(pLocal + l);
+		V qy = V::Load(pLocal + N + l);
+		V qz = V::Load(pLocal + 2 * N + l);
+		V qw = V::Load(pLocal + 3 * N + l);
+		V tx = V::Load(pLocal + 4 * N + l);
+		V ty = V::Load(pLocal + 5 * N + l);
+		V tz = V::Load(pLocal + 6 * N + l);
+		const unsigned int* pParents = &Stream.Parents[l];
+
+		if(Mode == SKINNING_DQ)
+		{
+			DualQuatLanes<V> Local;
+			Local.rx = qx;
+			Local.ry = qy;
+			Local.rz = qz;
+			Local.rw = qw;
+			Local.dw = MinusHalf * (tx * qx + ty * qy + tz * qz);
+			Local.dx = Half * (tx * qw + ty * qz - tz * qy);
+			Local.dy = Half * (ty * qw + tz * qx - tx * qz);
+			Local.dz = Half * (tx * qy - ty * qx + tz * qw);
+			NormalizeDQLanes(Local);
+
+			DualQuatLanes<V> Global = MulDQLanes(GatherDQLanes<V>(pGlobal, N, pParents), Local);
+			NormalizeDQLanes(Global);
+			StoreDQLanes(Global, pGlobal + l, N);
+			continue;
+		}
+
+		V xx = qx * qx, yy = qy * qy, zz = qz * qz;
+		V xy = qx * qy, xz = qx * qz, yz = qy * qz;
+		V wx = qw * qx, wy = qw * qy, wz = qw * qz;
+
+		AffineLanes<V> Local;
+		Local.m[0] = One - Two * (yy + zz);
+		Local.m[1] = Two * (xy - wz);
+		Local.m[2] = Two * (xz + wy);
+		Local.m[3] = tx;
+		Local.m[4] = Two * (xy + wz);
+		Local.m[5] = One - Two * (xx + zz);
+		Local.m[6] = Two * (yz - wx);
+		Local.m[7] = ty;
+		Local.m[8] = Two * (xz - wy);
+		Local.m[9] = Two * (yz + wx);
+		Local.m[10] = One - Two * (xx + yy);
+		Local.m[11] = tz;
+
+		const unsigned int* pMask = &Stream.ChannelMasks[l];
+		for(unsigned int i = 0; i < HIERARCHY_AFFINE_COMPONENTS; i++)
+			Local.m[i] = V::Select(pMask, Local.m[i], V::Load(&Stream.ConstantLocals[i * N + l]));
+
+		AffineLanes<V> Global = MulAffineLanes(GatherAffineLanes<V>(pGlobal, N, pParents), Local);
+		for(unsigned int i = 0; i < HIERARCHY_AFFINE_COMPONENTS; i++)
+			Global.m[i].Store(pGlobal + i * N + l);
+	}
+}
+
+// Global transform times bone offset for every bone lane, written straight
+// into pPalette in Mode's layout: 8 floats per bone for a mat2x4 dual
+// quaternion, 16 for a mat4 and 12 for an affine mat3x4.
+template<typename V>
+HIERARCHY_INLINE void BuildPaletteLanes(const HierarchyStream& Stream, SkinningMode Mode, const float* pGlobal, float* pPalette)
+{
+	unsigned int N = Stream.NumLanes;
+	unsigned int B = Stream.NumBoneLanes;
+	float Out[HIERARCHY_AFFINE_COMPONENTS][V::Width];
+
+	for(unsigned int b = 0; b < B; b += V::Width)
+	{
+		const unsigned int* pLanes = &Stream.BoneLanes[b];
+		if(Mode == SKINNING_DQ)
+		{
+			DualQuatLanes<V> Final = MulDQLanes(GatherDQLanes<V>(pGlobal, N, pLanes), LoadDQLanes<V>(&Stream.OffsetsDQ[b], B));
+			NormalizeDQLanes(Final);
+			StoreDQLanes(Final, &Out[0][0], V::Width);
+
+			for(unsigned int l = 0; l < (unsigned int)V::Width; l++)
+			{
+				int Bone = Stream.Bones[b + l];
+				if(Bone == INVALID_JOINT)
+					continue;
+				float* pOut = pPalette + Bone * HIERARCHY_DQ_COMPONENTS;
+				for(unsigned int i = 0; i < HIERARCHY_DQ_COMPONENTS; i++)
+					pOut[i] = Out[i][l];
+			}
+			continue;
+		}
+
+		AffineLanes<V> Final = MulAffineLanes(GatherAffineLanes<V>(pGlobal, N, pLanes), LoadAffineLanes<V>(&Stream.OffsetsAffine[b], B));
+		for(unsigned int i = 0; i < HIERARCHY_AFFINE_COMPONENTS; i++)
+			Final.m[i].Store(Out[i]);
+
+		for(unsigned int l = 0; l < (unsigned int)V::Width; l++)
+		{
+			int Bone = Stream.Bones[b + l];
+			if(Bone == INVALID_JOINT)
+				continue;
+			if(Mode == SKINNING_AFFINE)
+			{
+				float* pOut = pPalette + Bone * HIERARCHY_AFFINE_COMPONENTS;
+				for(unsigned int i = 0; i < HIERARCHY_AFFINE_COMPONENTS; i++)
+					pOut[i] = Out[i][l];
+				continue;
+			}
+
+			float* pOut = pPalette + Bone * 16;
+			for(unsigned int Col = 0; Col < 4; Col++)
+			{
+				pOut[Col * 4] = Out[Col][l];
+				pOut[Col * 4 + 1] = Out[4 + Col][l];
+				pOut[Col * 4 + 2] = Out[8 + Col][l];
+				pOut[Col * 4 + 3] = Col == 3 ? 1.0f : 0.0f;
+			}
+		}
+	}
+}
+
+// pLocal holds HIERARCHY_LOCAL_COMPONENTS and pGlobal up to
+// HIERARCHY_AFFINE_COMPONENTS floats per lane, component-major with a
+// stride of Stream.NumLanes. Every ISA does the same operations in the same
+// order, so they agree bit for bit.
+typedef void (*HierarchyKernel)(const HierarchyStream& Stream, SkinningMode Mode, const float* pLocal, float* pGlobal);
+typedef void (*PaletteKernel)(const HierarchyStream& Stream, SkinningMode Mode, const float* pGlobal, float* pPalette);
+
+inline void EvaluateLevelsScalar(const HierarchyStream& Stream, SkinningMode Mode, const float* pLocal, float* pGlobal)
+{
+	EvaluateLevels<Lanes1>(Stream, Mode, pLocal, pGlobal);
+}
+
+inline void BuildPaletteScalar(const HierarchyStream& Stream, SkinningMode Mode, const float* pGlobal, float* pPalette)
+{
+	BuildPaletteLanes<Lanes1>(Stream, Mode, pGlobal, pPalette);
+}
+
+#ifdef SAMPLER_SSE
+inline void EvaluateLevelsSSE(const HierarchyStream& Stream, SkinningMode Mode, const float* pLocal, float* pGlobal)
+{
+	EvaluateLevels<Lanes4>(Stream, Mode, pLocal, pGlobal);
+}
+
+inline void BuildPaletteSSE(const HierarchyStream& Stream, SkinningMode Mode, const float* pGlobal, float* pPalette)
+{
+	BuildPaletteLanes<Lanes4>(Stream, Mode, pGlobal, pPalette);
+}
+#endif
+
+#ifdef SAMPLER_AVX
+SAMPLER_AVX_TARGET inline void EvaluateLevelsAVX(const HierarchyStream& Stream, SkinningMode Mode, const float* pLocal, float* pGlobal)
+{
+	EvaluateLevels<Lanes8>(Stream, Mode, pLocal, pGlobal);
+}
+
+SAMPLER_AVX_TARGET inline void BuildPaletteAVX(const HierarchyStream& Stream, SkinningMode Mode, const float* pGlobal, float* pPalette)
+{
+	BuildPaletteLanes<Lanes8>(Stream, Mode, pGlobal, pPalette);
+}
+#endif
+
+inline HierarchyKernel SelectHierarchyKernel(SamplerISA ISA)
+{
+#ifdef SAMPLER_AVX
+	if(ISA == SAMPLER_ISA_AVX)
+		return EvaluateLevelsAVX;
+#endif
+#ifdef SAMPLER_SSE
+	if(ISA != SAMPLER_ISA_SCALAR)
+		return EvaluateLevelsSSE;
+#endif
+	return EvaluateLevelsScalar;
+}
+
+inline PaletteKernel SelectPaletteKernel(SamplerISA ISA)
+{
+#ifdef SAMPLER_AVX
+	if(ISA == SAMPLER_ISA_AVX)
+		return BuildPaletteAVX;
+#endif
+#ifdef SAMPLER_SSE
+	if(ISA != SAMPLER_ISA_SCALAR)
+		return BuildPaletteSSE;
+#endif
+	return BuildPaletteScalar;
+}
+#endif
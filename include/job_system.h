@@ -0,0 +1,342 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+typedef function<void()> JobFunction;
+
+// Number of unfinished jobs attached to it; JobSystem::Wait blocks on it.
+struct JobCounter
+{
+	atomic<int> Pending;
+
+	JobCounter()
+	{
+		Pending = 0;
+	}
+};
+
+struct Job
+{
+	const char* Name;
+	JobFunction Function;
+	JobCounter* Counter;
+	// Main-thread jobs (GL calls) only run inside JobSystem::Wait.
+	bool MainThread;
+
+	// Jobs that must finish first, and jobs waiting on this one.
+	vector<Job*> Dependencies;
+	vector<Job*> Dependents;
+	atomic<int> Blockers;
+	bool Finished;
+	mutex Lock;
+
+	// Filled in when the job runs: worker 0 is the main thread.
+	int Worker;
+	double Start;
+	double End;
+};
+
+// Work-stealing scheduler. Every thread owns a deque: it pushes and pops
+// its own jobs at the back and steals from the front of the others, so
+// a job's continuations tend to run on the thread whose cache holds its
+// data. Jobs are created and submitted on the main thread and live until
+// the next BeginFrame, which keeps their timings readable after Wait.
+class JobSystem
+{
+public:
+	// NumThreads counts the main thread; 0 uses every hardware thread.
+	JobSystem(unsigned int NumThreads = 0)
+	{
+		if(NumThreads == 0)
+			NumThreads = thread::hardware_concurrency();
+		if(NumThreads == 0)
+			NumThreads = 1;
+
+		m_Queued = 0;
+		m_MainQueued = 0;
+		m_Quit = false;
+		m_Epoch = chrono::steady_clock::now();
+		m_FrameStart = 0.0;
+		m_Queues = vector<WorkQueue>(NumThreads);
+
+		for(unsigned int i = 1; i < NumThreads; i++)
+			m_Threads.push_back(thread(&JobSystem::workerLoop, this, i));
+	}
+
+	~JobSystem()
+	{
+		{
+			lock_guard<mutex> lock(m_SleepMutex);
+			m_Quit = true;
+		}
+		m_Wake.notify_all();
+		for(unsigned int i = 0; i < m_Threads.size(); i++)
+			m_Threads[i].join();
+	}
+
+	unsigned int NumThreads() const
+	{
+		return (unsigned int)m_Queues.size();
+	}
+
+	// Releases the previous frame's jobs. Everything submitted must be done.
+	void BeginFrame()
+	{
+		m_Jobs.clear();
+		m_FrameStart = now();
+	}
+
+	Job* Create(const char* Name, const JobFunction& Function, JobCounter* Counter = nullptr, bool MainThread = false)
+	{
+		m_Jobs.push_back(JobSlot());
+		Job* pJob = &m_Jobs.back().Value;
+		pJob->Name = Name;
+		pJob->Function = Function;
+		pJob->Counter = Counter;
+		pJob->MainThread = MainThread;
+		pJob->Blockers = 1;
+		pJob->Finished = false;
+		pJob->Worker = -1;
+		pJob->Start = 0.0;
+		pJob->End = 0.0;
+
+		if(Counter)
+			Counter->Pending++;
+		return pJob;
+	}
+
+	// pJob will not start before pDependency has finished. Call before
+	// submitting pJob.
+	void DependsOn(Job* pJob, Job* pDependency)
+	{
+		pJob->Dependencies.push_back(pDependency);
+
+		lock_guard<mutex> lock(pDependency->Lock);
+		if(pDependency->Finished)
+			return;
+		pDependency->Dependents.push_back(pJob);
+		pJob->Blockers++;
+	}
+
+	void Submit(Job* pJob)
+	{
+		if(--pJob->Blockers == 0)
+			enqueue(pJob, 0);
+	}
+
+	// Runs jobs on the main thread until Counter reaches zero. This is the
+	// only place main-thread jobs run.
+	void Wait(JobCounter& Counter)
+	{
+		while(Counter.Pending > 0)
+		{
+			Job* pJob = popMainThread();
+			if(!pJob)
+				pJob = findJob(0);
+			if(pJob)
+			{
+				run(pJob, 0);
+				continue;
+			}
+
+			unique_lock<mutex> lock(m_SleepMutex);
+			m_Wake.wait(lock, [this, &Counter] { return Counter.Pending == 0 || m_Queued > 0 || m_MainQueued > 0; });
+		}
+	}
+
+	// Jobs of the current frame in creation order, with their timings in
+	// milliseconds since BeginFrame.
+	unsigned int NumJobs() const
+	{
+		return (unsigned int)m_Jobs.size();
+	}
+
+	const Job& GetJob(unsigned int Index) const
+	{
+		return m_Jobs[Index].Value;
+	}
+
+	double FrameTime(double Time) const
+	{
+		return (Time - m_FrameStart) * 1000.0;
+	}
+
+	// The chain of jobs that decided when the frame finished: starting from
+	// the job that ended last, each step goes to the dependency that ended
+	// last. Returned in execution order.
+	vector<const Job*> CriticalPath() const
+	{
+		vector<const Job*> Path;
+		const Job* pLast = nullptr;
+		for(unsigned int i = 0; i < m_Jobs.size(); i++)
+			if(!pLast || m_Jobs[i].Value.End > pLast->End)
+				pLast = &m_Jobs[i].Value;
+
+		while(pLast)
+		{
+			Path.insert(Path.begin(), pLast);
+			const Job* pPrevious = nullptr;
+			for(unsigned int i = 0; i < pLast->Dependencies.size(); i++)
+				if(!pPrevious || pLast->Dependencies[i]->End > pPrevious->End)
+					pPrevious = pLast->Dependencies[i];
+			pLast = pPrevious;
+		}
+		return Path;
+	}
+
+private:
+	struct WorkQueue
+	{
+		mutex Lock;
+		deque<Job*> Jobs;
+
+		WorkQueue() {}
+		WorkQueue(const WorkQueue&) {}
+	};
+
+	// Job holds a mutex and an atomic, so it is wrapped to live in a deque.
+	struct JobSlot
+	{
+		Job Value;
+
+		JobSlot() {}
+		JobSlot(const JobSlot&) {}
+	};
+
+	vector<thread> m_Threads;
+	vector<WorkQueue> m_Queues;
+	WorkQueue m_MainQueue;
+	deque<JobSlot> m_Jobs;
+
+	mutex m_SleepMutex;
+	condition_variable m_Wake;
+	atomic<int> m_Queued;
+	atomic<int> m_MainQueued;
+	bool m_Quit;
+
+	chrono::steady_clock::time_point m_Epoch;
+	double m_FrameStart;
+
+	double now() const
+	{
+		return chrono::duration<double>(chrono::steady_clock::now() - m_Epoch).count();
+	}
+
+	void enqueue(Job* pJob, int Worker)
+	{
+		if(pJob->MainThread)
+		{
+			{
+				lock_guard<mutex> lock(m_MainQueue.Lock);
+				m_MainQueue.Jobs.push_back(pJob);
+			}
+			lock_guard<mutex> lock(m_SleepMutex);
+			m_MainQueued++;
+			m_Wake.notify_all();
+			return;
+		}
+
+		{
+			lock_guard<mutex> lock(m_Queues[Worker].Lock);
+			m_Queues[Worker].Jobs.push_back(pJob);
+		}
+		lock_guard<mutex> lock(m_SleepMutex);
+		m_Queued++;
+		m_Wake.notify_all();
+	}
+
+	Job* popMainThread()
+	{
+		lock_guard<mutex> lock(m_MainQueue.Lock);
+		if(m_MainQueue.Jobs.empty())
+			return nullptr;
+
+		Job* pJob = m_MainQueue.Jobs.front();
+		m_MainQueue.Jobs.pop_front();
+		m_MainQueued--;
+		return pJob;
+	}
+
+	// Own deque from the back, then the others from the front.
+	Job* findJob(int Worker)
+	{
+		unsigned int NumQueues = (unsigned int)m_Queues.size();
+		for(unsigned int i = 0; i < NumQueues; i++)
+		{
+			unsigned int Victim = (Worker + i) % NumQueues;
+			WorkQueue& Queue = m_Queues[Victim];
+			lock_guard<mutex> lock(Queue.Lock);
+			if(Queue.Jobs.empty())
+				continue;
+
+			Job* pJob;
+			if(i == 0)
+			{
+				pJob = Queue.Jobs.back();
+				Queue.Jobs.pop_back();
+			}
+			else
+			{
+				pJob = Queue.Jobs.front();
+				Queue.Jobs.pop_front();
+			}
+			m_Queued--;
+			return pJob;
+		}
+		return nullptr;
+	}
+
+	void run(Job* pJob, int Worker)
+	{
+		pJob->Worker = Worker;
+		pJob->Start = now();
+		pJob->Function();
+		pJob->End = now();
+
+		vector<Job*> Ready;
+		{
+			lock_guard<mutex> lock(pJob->Lock);
+			pJob->Finished = true;
+			for(unsigned int i = 0; i < pJob->Dependents.size(); i++)
+				if(--pJob->Dependents[i]->Blockers == 0)
+					Ready.push_back(pJob->Dependents[i]);
+		}
+		for(unsigned int i = 0; i < Ready.size(); i++)
+			enqueue(Ready[i], Worker);
+
+		if(pJob->Counter && --pJob->Counter->Pending == 0)
+		{
+			lock_guard<mutex> lock(m_SleepMutex);
+			m_Wake.notify_all();
+		}
+	}
+
+	void workerLoop(int Worker)
+	{
+		for(;;)
+		{
+			Job* pJob = findJob(Worker);
+			if(pJob)
+			{
+				run(pJob, Worker);
+				continue;
+			}
+
+			unique_lock<mutex> lock(m_SleepMutex);
+			m_Wake.wait(lock, [this] { return m_Quit || m_Queued > 0; });
+			if(m_Quit)
+				return;
+		}
+	}
+};
+#endif
@@ -7,13 +7,26 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "shader.h"
+#include "vertex_layout.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <string>
 #include <vector>
 using namespace std;
 using namespace glm;
 
-#define NUM_BONES_PER_VERTEX 4
+// Most influences any bone stream holds.
+#define MAX_BONES_PER_VERTEX 8
+// Most influences a vertex keeps at import, unless the asset is loaded with
+// another count: 2, 4 or 8. Hero characters can be loaded with 8 next to
+// assets that keep 4; skeletal LODs keep fewer (see SKELETON_LOD_INFLUENCES).
+#ifndef DEFAULT_BONES_PER_VERTEX
+#define DEFAULT_BONES_PER_VERTEX 4
+#endif
+// Influences lighter than this are dropped at import before renormalizing.
+#define SKIN_WEIGHT_THRESHOLD 0.01f
 #define ZERO_MEM(a) memset(a, 0, sizeof(a))
 #define ARRAY_SIZE_IN_ELEMENTS(a) (sizeof(a)/sizeof(a[0]))
 #define INVALID_MATERIAL 0xFFFFFFFF
@@ -24,6 +37,7 @@ struct Vertex
     vec3 Normal;
     vec2 TexCoords;
 };
+VERTEX_LAYOUT_CHECK(Vertex, FLOAT_VERTEX_LAYOUT)
 
 struct Texture
 {
@@ -54,29 +68,34 @@ vector<GLuint> m_Textures;
 struct BoneInfo
 {
 	mat4 offset;
-	mat4 FinalTransformation;
-	fdualquat FinalTransformationDQ;
+	// offset as a dual quaternion, built once when the bone is registered.
+	fdualquat offsetDQ;
 	BoneInfo()
 	{
 		offset = mat4(0.0f);
-		FinalTransformation = mat4(0.0f);
-		FinalTransformationDQ = fdualquat(quat(1.f, 0.f, 0.f, 0.f), quat(0.f, 0.f, 0.f, 0.f));
+		offsetDQ = fdualquat(quat(1.f, 0.f, 0.f, 0.f), quat(0.f, 0.f, 0.f, 0.f));
 	}
 };
 
-struct VertexBoneData
+// Bone influences of one vertex, at most N of them. Slots past the last
+// influence have zero weight.
+template<unsigned int N>
+struct BasicVertexBoneData
 {
-	unsigned int BoneIDs[NUM_BONES_PER_VERTEX];
-	float Weights[NUM_BONES_PER_VERTEX];
+	static_assert(N == 2 || N == 4 || N == 8, "skinning supports 2, 4 or 8 influences per vertex");
+	enum { NumInfluences = N };
 
-	VertexBoneData()
+	unsigned int BoneIDs[N];
+	float Weights[N];
+
+	BasicVertexBoneData()
 	{
 		Reset();
 	};
 
 	void Reset()
 	{
-		for (unsigned int i = 0; i < NUM_BONES_PER_VERTEX; ++i)
+		for (unsigned int i = 0; i < N; ++i)
 		{
 			BoneIDs[i] = 0;
 			Weights[i] = 0;
@@ -85,7 +104,7 @@ struct VertexBoneData
 	
 	void AddBoneData(unsigned int BoneID, float Weight)
 	{
-		for (unsigned int i = 0; i < NUM_BONES_PER_VERTEX; i++) {
+		for (unsigned int i = 0; i < N; i++) {
 			if (Weights[i] == 0.0) {
 				BoneIDs[i] = BoneID;
 				Weights[i] = Weight;
@@ -93,7 +112,312 @@ struct VertexBoneData
 			}
 		}
 	}
+
+	// Adds Weight to BoneID's slot if it already has one.
+	void MergeBoneData(unsigned int BoneID, float Weight)
+	{
+		for (unsigned int i = 0; i < N; i++) {
+			if (Weights[i] != 0.0 && BoneIDs[i] == BoneID) {
+				Weights[i] += Weight;
+				return;
+			}
+		}
+		AddBoneData(BoneID, Weight);
+	}
+
+	// Keeps the Count heaviest of Influences (weight, bone) that weigh at
+	// least Threshold, the heaviest one always, sorted heaviest first and
+	// scaled to sum to 1.
+	void Assign(vector<pair<float, unsigned int> > Influences, unsigned int Count, float Threshold)
+	{
+		Reset();
+		sort(Influences.begin(), Influences.end(), [](const pair<float, unsigned int>& a, const pair<float, unsigned int>& b) { return a.first > b.first; });
+
+		unsigned int Kept = 0;
+		float Total = 0.0f;
+		for(unsigned int i = 0; i < Influences.size() && Kept < min(Count, N); i++)
+		{
+			if(Influences[i].first <= 0.0f || (Kept > 0 && Influences[i].first < Threshold))
+				break;
+			BoneIDs[Kept] = Influences[i].second;
+			Weights[Kept] = Influences[i].first;
+			Total += Weights[Kept++];
+		}
+		for(unsigned int i = 0; i < Kept; i++)
+			Weights[i] /= Total;
+	}
+
+	// Assign over this vertex's own influences, e.g. to drop to fewer
+	// influences for a skeletal LOD.
+	void Limit(unsigned int Count, float Threshold)
+	{
+		vector<pair<float, unsigned int> > Influences;
+		for(unsigned int i = 0; i < N; i++)
+			if(Weights[i] != 0.0f)
+				Influences.push_back(make_pair(Weights[i], BoneIDs[i]));
+		Assign(Influences, Count, Threshold);
+	}
+};
+
+// Influences of one vertex while they are gathered and folded at load,
+// wide enough for any bone stream.
+typedef BasicVertexBoneData<MAX_BONES_PER_VERTEX> VertexBoneData;
+
+// The influences of every vertex of a mesh for one skeletal LOD, stored as
+// BasicVertexBoneData<NumInfluences> in whichever of Bones2, Bones4 and
+// Bones8 matches; the other two stay empty. Streams of different widths
+// live side by side in one build. Code that knows the width reads the typed
+// vector, the rest goes through BoneID and Weight.
+struct BoneStream
+{
+	unsigned int NumInfluences;
+	vector<BasicVertexBoneData<2> > Bones2;
+	vector<BasicVertexBoneData<4> > Bones4;
+	vector<BasicVertexBoneData<8> > Bones8;
+
+	BoneStream()
+	{
+		NumInfluences = 2;
+	}
+
+	// Stores boneData numInfluences wide, rounded up to 2, 4 or 8. The
+	// vertices must already be limited to that many influences.
+	void Assign(const vector<VertexBoneData>& boneData, unsigned int numInfluences)
+	{
+		NumInfluences = numInfluences <= 2 ? 2 : numInfluences <= 4 ? 4 : 8;
+		Bones2.clear();
+		Bones4.clear();
+		Bones8.clear();
+		if(NumInfluences == 2)
+			store(boneData, Bones2);
+		else if(NumInfluences == 4)
+			store(boneData, Bones4);
+		else
+			store(boneData, Bones8);
+	}
+
+	// Restores the stream numInfluences wide; the new slots weigh nothing.
+	void Widen(unsigned int numInfluences)
+	{
+		vector<VertexBoneData> boneData(Size());
+		for(unsigned int v = 0; v < Size(); v++)
+			for(unsigned int k = 0; k < NumInfluences; k++)
+			{
+				boneData[v].BoneIDs[k] = BoneID(v, k);
+				boneData[v].Weights[k] = Weight(v, k);
+			}
+		Assign(boneData, numInfluences);
+	}
+
+	unsigned int Size() const
+	{
+		return (unsigned int)(NumInfluences == 2 ? Bones2.size() : NumInfluences == 4 ? Bones4.size() : Bones8.size());
+	}
+
+	// Slot k of vertex v, for k below NumInfluences.
+	unsigned int BoneID(unsigned int v, unsigned int k) const
+	{
+		return NumInfluences == 2 ? Bones2[v].BoneIDs[k] : NumInfluences == 4 ? Bones4[v].BoneIDs[k] : Bones8[v].BoneIDs[k];
+	}
+
+	const float* Weights(unsigned int v) const
+	{
+		return NumInfluences == 2 ? Bones2[v].Weights : NumInfluences == 4 ? Bones4[v].Weights : Bones8[v].Weights;
+	}
+
+	float Weight(unsigned int v, unsigned int k) const
+	{
+		return Weights(v)[k];
+	}
+
+	// The narrowest width, 2, 4 or 8, that holds every vertex of boneData,
+	// and never more than Count rounded up.
+	static unsigned int Width(const vector<VertexBoneData>& boneData, unsigned int Count)
+	{
+		unsigned int Used = 1;
+		for(unsigned int v = 0; v < boneData.size(); v++)
+			for(unsigned int k = Used; k < MAX_BONES_PER_VERTEX; k++)
+				if(boneData[v].Weights[k] != 0.0f)
+					Used = k + 1;
+		Used = min(Used, Count);
+		return Used <= 2 ? 2 : Used <= 4 ? 4 : 8;
+	}
+
+private:
+	template<unsigned int N>
+	static void store(const vector<VertexBoneData>& boneData, vector<BasicVertexBoneData<N> >& Out)
+	{
+		Out.resize(boneData.size());
+		for(unsigned int v = 0; v < boneData.size(); v++)
+			for(unsigned int k = 0; k < N; k++)
+			{
+				Out[v].BoneIDs[k] = boneData[v].BoneIDs[k];
+				Out[v].Weights[k] = boneData[v].Weights[k];
+			}
+	}
+};
+
+// Skin attributes as uploaded: per vertex NumInfluences bone indices of one
+// byte each (two when the data names a bone past 255), then as many unorm16
+// weights. Weights are renormalized and rounded so they sum to exactly
+// 65535, so the shader reads weights summing to 1. Four influences take 12
+// or 16 bytes a vertex against 32 for BasicVertexBoneData<4>. Influences go to the
+// shader four at a time: BoneIDs / Weights, then BoneIDs1 / Weights1.
+struct PackedSkinAttributes
+{
+	GLenum IndexType;
+	unsigned int IndexSize;
+	unsigned int NumInfluences;
+	unsigned int Stride;
+	vector<unsigned char> Data;
+
+	void Pack(const BoneStream& boneData)
+	{
+		NumInfluences = boneData.NumInfluences;
+		unsigned int MaxBone = 0;
+		for(unsigned int v = 0; v < boneData.Size(); v++)
+			for(unsigned int i = 0; i < NumInfluences; i++)
+				if(boneData.Weight(v, i) != 0.0f)
+					MaxBone = max(MaxBone, boneData.BoneID(v, i));
+
+		IndexType = MaxBone > 255 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+		IndexSize = MaxBone > 255 ? 2 : 1;
+		Stride = NumInfluences * (IndexSize + 2);
+		Data.assign(boneData.Size() * Stride, 0);
+
+		for(unsigned int v = 0; v < boneData.Size(); v++)
+		{
+			unsigned char* pVertex = &Data[v * Stride];
+			unsigned short Weights[MAX_BONES_PER_VERTEX];
+			QuantizeWeights(boneData.Weights(v), NumInfluences, Weights);
+			for(unsigned int i = 0; i < NumInfluences; i++)
+			{
+				unsigned int Bone = boneData.Weight(v, i) != 0.0f ? boneData.BoneID(v, i) : 0;
+				if(IndexSize == 2)
+				{
+					unsigned short Index = (unsigned short)Bone;
+					memcpy(pVertex + i * 2, &Index, 2);
+				}
+				else
+					pVertex[i] = (unsigned char)Bone;
+			}
+			memcpy(pVertex + WeightOffset(), Weights, NumInfluences * sizeof(unsigned short));
+		}
+	}
+
+	unsigned int WeightOffset() const
+	{
+		return NumInfluences * IndexSize;
+	}
+
+	// Points attributes 3 and 4 (and 5 and 6 past four influences) at the
+	// buffer bound to GL_ARRAY_BUFFER.
+	void SetupAttributes() const
+	{
+		for(unsigned int First = 0; First < NumInfluences; First += 4)
+		{
+			unsigned int Location = 3 + First / 2;
+			GLint Count = (GLint)min(NumInfluences - First, 4u);
+			glEnableVertexAttribArray(Location);
+			glVertexAttribIPointer(Location, Count, IndexType, Stride, (const GLvoid*)(size_t)(First * IndexSize));
+			glEnableVertexAttribArray(Location + 1);
+			glVertexAttribPointer(Location + 1, Count, GL_UNSIGNED_SHORT, GL_TRUE, Stride, (const GLvoid*)(size_t)(WeightOffset() + First * 2));
+		}
+	}
+
+	// Rounds the first Count Weights / their sum to unorm16, handing the
+	// units lost to rounding down to the largest remainders. All-zero
+	// weights stay zero.
+	static void QuantizeWeights(const float* Weights, unsigned int Count, unsigned short* Out)
+	{
+		float Total = 0.0f;
+		for(unsigned int i = 0; i < Count; i++)
+			Total += Weights[i];
+
+		unsigned int Sum = 0;
+		float Remainders[MAX_BONES_PER_VERTEX];
+		for(unsigned int i = 0; i < Count; i++)
+		{
+			float Scaled = Total > 0.0f ? Weights[i] / Total * 65535.0f : 0.0f;
+			Out[i] = (unsigned short)min(floor(Scaled), 65535.0f);
+			Remainders[i] = Scaled - Out[i];
+			Sum += Out[i];
+		}
+
+		while(Total > 0.0f && Sum < 65535)
+		{
+			unsigned int Largest = 0;
+			for(unsigned int i = 1; i < Count; i++)
+				if(Remainders[i] > Remainders[Largest])
+					Largest = i;
+			Out[Largest]++;
+			Remainders[Largest] -= 1.0f;
+			Sum++;
+		}
+	}
+};
+
+// Nearest half float, rounding ties to even.
+inline unsigned short FloatToHalf(float Value)
+{
+	unsigned int Bits;
+	memcpy(&Bits, &Value, sizeof(Bits));
+	unsigned int Sign = (Bits >> 16) & 0x8000;
+	int Exponent = (int)((Bits >> 23) & 0xFF) - 127 + 15;
+	unsigned int Mantissa = Bits & 0x7FFFFF;
+
+	if(Exponent >= 31)
+		return (unsigned short)(Sign | 0x7C00 | ((Bits & 0x7F800000) == 0x7F800000 && Mantissa != 0 ? 0x200 : 0));
+	unsigned int Shift = 13;
+	if(Exponent <= 0)
+	{
+		if(Exponent < -10)
+			return (unsigned short)Sign;
+		Mantissa |= 0x800000;
+		Shift = 14 - Exponent;
+		Exponent = 0;
+	}
+
+	// A carry out of the mantissa rounds up into the exponent, as it should.
+	unsigned int Half = ((unsigned int)Exponent << 10) + (Mantissa >> Shift);
+	unsigned int Rest = Mantissa & ((1u << Shift) - 1);
+	unsigned int Middle = 1u << (Shift - 1);
+	if(Rest > Middle || (Rest == Middle && (Half & 1)))
+		Half++;
+	return (unsigned short)(Sign | Half);
+}
+
+// Octahedral encoding of a normal into two snorm8 values.
+inline void EncodeOctahedral(const vec3& Normal, signed char* Out)
+{
+	float L1 = fabs(Normal.x) + fabs(Normal.y) + fabs(Normal.z);
+	float x = L1 > 0.0f ? Normal.x / L1 : 0.0f;
+	float y = L1 > 0.0f ? Normal.y / L1 : 0.0f;
+	if(Normal.z < 0.0f)
+	{
+		float Folded = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = Folded;
+	}
+	Out[0] = (signed char)floor(glm::clamp(x, -1.0f, 1.0f) * 127.0f + 0.5f);
+	Out[1] = (signed char)floor(glm::clamp(y, -1.0f, 1.0f) * 127.0f + 0.5f);
+}
+
+// One vertex of the quantized layout: the position as unorm16 within the
+// mesh bounds, the normal octahedral, half float UVs and the skin
+// attributes of PackedSkinAttributes with byte indices, in one 24-byte
+// stream. Only meshes with at most four influences whose bones all fit a
+// byte use it.
+#define PACKED_VERTEX_INFLUENCES 4
+struct PackedVertex
+{
+	unsigned short Position[3];
+	signed char Normal[2];
+	unsigned short TexCoords[2];
+	unsigned char BoneIDs[PACKED_VERTEX_INFLUENCES];
+	unsigned short Weights[PACKED_VERTEX_INFLUENCES];
 };
+VERTEX_LAYOUT_CHECK(PackedVertex, PACKED_VERTEX_LAYOUT)
 
 class Mesh
 {
@@ -102,21 +426,119 @@ public:
     vector<unsigned int> indices;
     vector<Texture> textures;
 	vector<BoneInfo> bones;
-	vector<VertexBoneData> vertexBoneData;    
+	BoneStream vertexBoneData;
+	// Bone streams of skeletal LOD 1 and up; LOD 0 uses vertexBoneData.
+	// Each holds its own number of influences, which the shader drawing
+	// that LOD must be built for.
+	vector<BoneStream> lodBoneData;
     unsigned int VAO;
-
-    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures, vector<BoneInfo> bones, vector<VertexBoneData> vertexBoneData)
+	vector<unsigned int> lodVAOs;
+	// False until Upload; meshes loaded without a GL context keep only CPU
+	// data.
+	bool uploaded;
+	// Whether the GPU copy uses PackedVertex, and the bounds its positions
+	// are quantized to; the shaders decode gPositionMin + aPos *
+	// gPositionExtent, which is the identity for float vertices.
+	bool packed;
+	vec3 positionMin;
+	vec3 positionExtent;
+
+    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures, vector<BoneInfo> bones, const BoneStream& vertexBoneData, bool packVertices = false)
     {
         this->vertices = vertices;
         this->indices = indices;
         this->textures = textures;
 		this->bones = bones;
 		this->vertexBoneData = vertexBoneData;        
-		
-		setupMesh();
+		this->uploaded = false;
+		this->packed = packVertices;
+		this->positionMin = vec3(0.0f);
+		this->positionExtent = vec3(1.0f);
+		this->VAO = 0;
     }
 
-    void Draw(Shader& shader)
+	// Creates the buffers and one VAO per bone stream, once every stream
+	// has its final width. The quantized layout is only used if it was
+	// asked for and LOD 0 fits it.
+	void Upload()
+	{
+		packed = packed && vertexBoneData.NumInfluences <= PACKED_VERTEX_INFLUENCES && bonesFitByte();
+		uploaded = true;
+		setupMesh();
+
+		for(unsigned int l = 0; l < lodBoneData.size(); l++)
+		{
+			unsigned int lodVAO, lodBones_vbo;
+			glGenBuffers(1, &lodBones_vbo);
+			setupVAO(lodVAO, lodBones_vbo, lodBoneData[l]);
+			lodVAOs.push_back(lodVAO);
+		}
+	}
+
+	// The vertices in the quantized layout, with LOD 0's skin attributes.
+	// Sets positionMin and positionExtent.
+	vector<PackedVertex> PackVertices()
+	{
+		positionMin = vertices.empty() ? vec3(0.0f) : vertices[0].Position;
+		vec3 Max = positionMin;
+		for(unsigned int v = 1; v < vertices.size(); v++)
+		{
+			positionMin = min(positionMin, vertices[v].Position);
+			Max = max(Max, vertices[v].Position);
+		}
+		positionExtent = Max - positionMin;
+
+		vector<PackedVertex> Packed(vertices.size());
+		for(unsigned int v = 0; v < vertices.size(); v++)
+		{
+			const Vertex& vertex = vertices[v];
+			PackedVertex& Out = Packed[v];
+			for(unsigned int c = 0; c < 3; c++)
+			{
+				float Unit = positionExtent[c] > 0.0f ? (vertex.Position[c] - positionMin[c]) / positionExtent[c] : 0.0f;
+				Out.Position[c] = (unsigned short)floor(glm::clamp(Unit, 0.0f, 1.0f) * 65535.0f + 0.5f);
+			}
+			EncodeOctahedral(vertex.Normal, Out.Normal);
+			Out.TexCoords[0] = FloatToHalf(vertex.TexCoords.x);
+			Out.TexCoords[1] = FloatToHalf(vertex.TexCoords.y);
+
+			unsigned int Count = v < vertexBoneData.Size() ? min(vertexBoneData.NumInfluences, (unsigned int)PACKED_VERTEX_INFLUENCES) : 0;
+			if(Count > 0)
+				PackedSkinAttributes::QuantizeWeights(vertexBoneData.Weights(v), Count, Out.Weights);
+			for(unsigned int i = 0; i < PACKED_VERTEX_INFLUENCES; i++)
+			{
+				if(i >= Count)
+					Out.Weights[i] = 0;
+				Out.BoneIDs[i] = (unsigned char)(i < Count && vertexBoneData.Weight(v, i) != 0.0f ? vertexBoneData.BoneID(v, i) : 0);
+			}
+		}
+		return Packed;
+	}
+
+	// Adds the bone stream for the next skeletal LOD, drawn with its own VAO
+	// over the same vertex and index buffers once the mesh is uploaded.
+	void AddBoneLOD(const BoneStream& boneData)
+	{
+		lodBoneData.push_back(boneData);
+	}
+
+	// The bone stream skeletal LOD draws with; LOD 0's past the last one.
+	BoneStream& BoneData(unsigned int LOD)
+	{
+		return LOD > 0 && LOD <= lodBoneData.size() ? lodBoneData[LOD - 1] : vertexBoneData;
+	}
+
+	const BoneStream& BoneData(unsigned int LOD) const
+	{
+		return LOD > 0 && LOD <= lodBoneData.size() ? lodBoneData[LOD - 1] : vertexBoneData;
+	}
+
+	unsigned int NumInfluences(unsigned int LOD) const
+	{
+		return BoneData(LOD).NumInfluences;
+	}
+
+    void Draw(const Shader& shader, unsigned int LOD = 0) const
     {
         unsigned int diffuseNr = 1;
         unsigned int specularNr = 1;
@@ -137,12 +559,14 @@ public:
             else if (name == "texture_height")
                 number = std::to_string(heightNr++);
 
-            glUniform1i(glGetUniformLocation(shader.ID, (name + number).c_str()), i);
+            shader.setInt(name + number, i);
 
             glBindTexture(GL_TEXTURE_2D, textures[i].id);
         }
+		shader.setVec3("gPositionMin", positionMin);
+		shader.setVec3("gPositionExtent", positionExtent);
 
-        glBindVertexArray(VAO);
+        glBindVertexArray(LOD > 0 && LOD <= lodVAOs.size() ? lodVAOs[LOD - 1] : VAO);
         glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
         glBindVertexArray(0);
 
@@ -152,40 +576,70 @@ public:
 private:
     unsigned int vertexData_vbo, EBO, vertexBones_vbo;
 
+	bool bonesFitByte() const
+	{
+		for(unsigned int v = 0; v < vertexBoneData.Size(); v++)
+			for(unsigned int i = 0; i < vertexBoneData.NumInfluences; i++)
+				if(vertexBoneData.Weight(v, i) != 0.0f && vertexBoneData.BoneID(v, i) > 255)
+					return false;
+		return true;
+	}
+
     void setupMesh()
     {
 		glGenBuffers(1, &vertexData_vbo);
-        glGenVertexArrays(1, &VAO);
         glGenBuffers(1, &EBO);
-		glGenBuffers(1, &vertexBones_vbo);
-
-        glBindVertexArray(VAO);
+		vertexBones_vbo = 0;
+		if(!packed)
+			glGenBuffers(1, &vertexBones_vbo);
 
         glBindBuffer(GL_ARRAY_BUFFER, vertexData_vbo);
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+		if(packed)
+		{
+			vector<PackedVertex> Packed = PackVertices();
+			glBufferData(GL_ARRAY_BUFFER, Packed.size() * sizeof(PackedVertex), Packed.empty() ? nullptr : &Packed[0], GL_STATIC_DRAW);
+		}
+		else
+			glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+
+		// Packed vertices already carry LOD 0's skin attributes.
+		setupVAO(VAO, vertexBones_vbo, vertexBoneData);
 
+		glBindVertexArray(VAO);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
         glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        glBindVertexArray(0);
+    }
 
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Normal));
-
-        glEnableVertexAttribArray(2);
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
+	void setupVAO(unsigned int& vao, unsigned int bones_vbo, const BoneStream& boneData)
+	{
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
 
-		glBindBuffer(GL_ARRAY_BUFFER, vertexBones_vbo);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(VertexBoneData) * vertexBoneData.size(), &vertexBoneData[0], GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, vertexData_vbo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
 
-		glEnableVertexAttribArray(3);
-		glVertexAttribIPointer(3, 4, GL_INT, sizeof(VertexBoneData), (const GLvoid*)0);
+		if(packed)
+		{
+			SETUP_VERTEX_LAYOUT(PACKED_VERTEX_LAYOUT)
+		}
+		else
+		{
+			SETUP_VERTEX_LAYOUT(FLOAT_VERTEX_LAYOUT)
+		}
 
-		glEnableVertexAttribArray(4);
-		glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(VertexBoneData), (const GLvoid*)16);
+		// A separate skin stream (the float layout, or a skeletal LOD)
+		// overrides the packed vertex's skin attributes.
+		if(bones_vbo != 0)
+		{
+			PackedSkinAttributes skin;
+			skin.Pack(boneData);
+			glBindBuffer(GL_ARRAY_BUFFER, bones_vbo);
+			glBufferData(GL_ARRAY_BUFFER, skin.Data.size(), skin.Data.empty() ? nullptr : &skin.Data[0], GL_STATIC_DRAW);
+			skin.SetupAttributes();
+		}
 
         glBindVertexArray(0);
-    }
+	}
 };
 #endif
\ No newline at end of file
@@ -15,6 +15,14 @@
 
 #include "mesh.h"
 #include "shader.h"
+#include "skeleton.h"
+#include "animation.h"
+#include "clip_compression.h"
+#include "skinning.h"
+#include "animation_instance.h"
+#include "clip_binding.h"
+#include "cpu_skinning.h"
+#include "worker_pool.h"
 #include "stb_image.h"
 
 #include <string>
@@ -23,6 +31,7 @@
 #include <iostream>
 #include <map>
 #include <vector>
+#include <cstring>
 
 #define STB_IMAGE_IMPLEMENTATION
 #define GLM_FORCE_CTOR_INIT
@@ -32,7 +41,10 @@ using namespace glm;
 unsigned int TextureFromFile(const char *path, const string &directory, bool gamma = false);
 mat4 converttoMat4(const aiMatrix4x4 &ai);
 
-class Model 
+// Everything loaded from one file: meshes, skeleton and clips. It is not
+// modified after loading, so any number of AnimationInstances can be
+// evaluated against it, including from several threads.
+class SkinnedModelAsset 
 {
 public:
 	Assimp::Importer importer;
@@ -42,63 +54,309 @@ public:
     
     string directory;
     bool gammaCorrection;
+    // Loaded without a GL context: no textures, VAOs or buffers, so only
+    // evaluation (and tools such as the palette bake check) can use it.
+    bool m_Headless;
+	// Uploads meshes in the quantized PackedVertex layout where they fit it.
+	bool m_PackedVertices;
+	// Most influences a vertex keeps at import (2, 4 or 8). Bone streams are
+	// only as wide as their busiest vertex needs.
+	unsigned int m_MaxInfluences;
     
     unsigned int total_vertices = 0;
     
     unsigned int m_NumBones = 0;
 	vector<VertexBoneData> Bones;
 	map<string, unsigned int> Bone_Mapping;
-	map<string, map<string, const aiNodeAnim*>> Animations;
+	vector<AnimationClip> Clips;
 	vector<BoneInfo> m_BoneInfo;
 	unsigned int NumVertices = 0;
+
+	// The bind-pose skeleton, not bound to any clip, and its skeletal LODs:
+	// which joints each level keeps and where culled bones' weights go.
+	// Level 0 keeps every joint.
+	Skeleton m_Skeleton;
+	vector<SkeletonLOD> m_LODs;
+	// How far each joint's subtree reaches into the mesh; see buildSkeletonLODs.
+	vector<float> m_JointExtents;
+	// One per clip, indexed by ClipHandle. Each lists, per LOD, the joints
+	// with a changing channel and the joints whose global transform changes
+	// (the animated ones plus everything below them) that it evaluates.
+	vector<ClipBinding> m_Bindings;
+	
+	ClipCompressionSettings m_Compression;
+	vector<ClipCompressionReport> CompressionReports;
 	
 	mat4 m_GlobalInverseTransform = mat4(1.f);
 	fdualquat IdentityDQ = fdualquat(quat(1.f, 0.f, 0.f, 0.f), quat(0.f, 0.f, 0.f, 0.f));
 	fdualquat InverseDQ = IdentityDQ;
 
-    Model(string const &path, bool gamma = false) : gammaCorrection(gamma)
+	// Kernel for the bindings' SoA rotation streams, picked from the CPU at
+	// load.
+	SamplerISA m_SamplerISA;
+	RotationKernel m_InterpolateRotations;
+
+	// Kernels for the bindings' hierarchy streams. Without them every joint
+	// goes through EvaluateGlobalDQ / EvaluateGlobalMatrix one at a time.
+	bool m_UseHierarchyKernel;
+	SamplerISA m_HierarchyISA;
+	HierarchyKernel m_EvaluateLevels;
+	PaletteKernel m_BuildPaletteLanes;
+
+	// Each mesh's vertices for CPU skinning, and the ISA of the kernels that
+	// skin them; each bone stream gets the kernel for its influence count.
+	vector<SkinningStream> m_SkinningStreams;
+	SamplerISA m_SkinningISA;
+
+    SkinnedModelAsset(string const &path, bool gamma = false, const ClipCompressionSettings& compression = ClipCompressionSettings(), bool headless = false, bool packedVertices = false,
+		unsigned int maxInfluences = DEFAULT_BONES_PER_VERTEX) : gammaCorrection(gamma), m_Headless(headless), m_PackedVertices(packedVertices), m_MaxInfluences(maxInfluences), m_Compression(compression)
     {
         loadModel(path);
     }
 
-    void Draw(Shader shader)
+	// Loads from a scene built in memory, e.g. a generated skeleton for a
+	// benchmark. Always headless; pScene must outlive the asset.
+	SkinnedModelAsset(const aiScene* pScene, const ClipCompressionSettings& compression = ClipCompressionSettings(), unsigned int maxInfluences = DEFAULT_BONES_PER_VERTEX)
+		: gammaCorrection(false), m_Headless(true), m_PackedVertices(false), m_MaxInfluences(maxInfluences), m_Compression(compression)
+	{
+		scene = pScene;
+		loadScene();
+	}
+
+	// Picks the per-joint path or the hierarchy kernel for ISA. Like loading,
+	// this must not race with evaluation.
+	void UseHierarchyKernel(bool Enable, SamplerISA ISA)
+	{
+		m_UseHierarchyKernel = Enable;
+		m_HierarchyISA = ISA;
+		m_EvaluateLevels = SelectHierarchyKernel(ISA);
+		m_BuildPaletteLanes = SelectPaletteKernel(ISA);
+	}
+
+	// Picks the CPU skinning kernel; SAMPLER_ISA_SCALAR is the reference the
+	// others match bit for bit.
+	void UseSkinningKernel(SamplerISA ISA)
+	{
+		m_SkinningISA = ISA;
+	}
+
+	// Skins every mesh on the CPU with the instance's palette, which must be
+	// evaluated, into Out[mesh]. Uses the bone streams of the instance's
+	// skeletal LOD and no GL, so it works on headless assets.
+	void Skin(WorkerPool& Pool, const AnimationInstance& Instance, vector<SkinnedVertices>& Out) const
+	{
+		Out.resize(m_SkinningStreams.size());
+		for(unsigned int m = 0; m < m_SkinningStreams.size(); m++)
+			SkinMesh(Pool, m_SkinningISA, m_SkinningStreams[m], LODIndex(Instance), Instance.Palette, Out[m]);
+	}
+
+    void Draw(const Shader& shader, unsigned int LOD = 0) const
     {
         for(unsigned int i = 0; i < meshes.size(); i++)
-            meshes[i].Draw(shader);
+            meshes[i].Draw(shader, LOD);
     }
 
-	void BoneTransform(float TimeInSeconds, vector<mat4>& Transforms, vector<fdualquat>& dqs)
+	// Influences per vertex the bone streams of skeletal LOD hold, the same
+	// for every mesh; draw it with a shader variant built for that many (see
+	// SkinningPermutation).
+	unsigned int NumInfluences(unsigned int LOD) const
 	{
-		mat4 Identity = mat4(1.0f);
-		
-//		aiScene scen = *scene;
-//		aiAnimation anim = *scen.mAnimations[0];
-//		aiNodeAnim ch = *anim.mChannels[0];
-		
-		if(scene->mAnimations)
+		return meshes.empty() ? m_MaxInfluences : meshes[0].NumInfluences(LOD);
+	}
+
+	unsigned int NumLODs() const
+	{
+		return (unsigned int)m_LODs.size();
+	}
+
+	unsigned int NumClips() const
+	{
+		return (unsigned int)Clips.size();
+	}
+
+	// Handle of the clip called Name, or INVALID_CLIP. Handles are for
+	// AnimationInstance::Clip; look them up once, not per frame.
+	ClipHandle FindClip(const string& Name) const
+	{
+		for(unsigned int i = 0; i < Clips.size(); i++)
+			if(Clips[i].Name == Name)
+				return i;
+		return INVALID_CLIP;
+	}
+
+	// Samples Instance.Clip at Instance.Time and writes the palette for
+	// Instance.Mode; the other palettes are left empty. Only the instance is
+	// written to.
+	void Evaluate(AnimationInstance& Instance) const
+	{
+		Sample(Instance);
+		EvaluateHierarchy(Instance);
+		BuildPalette(Instance);
+	}
+
+	// The three stages of Evaluate, for callers that schedule them
+	// separately. Each must finish before the next starts on the same
+	// instance.
+	void Sample(AnimationInstance& Instance) const
+	{
+		Sample(Instance, Instance.Time);
+	}
+
+	// Samples at Time seconds instead of Instance.Time, e.g. a PoseCache time.
+	void Sample(AnimationInstance& Instance, float Time) const
+	{
+		if(Clips.empty())
+			return;
+
+		if(Instance.BoundClip != (int)Instance.Clip || Instance.BoundMode != Instance.Mode)
+			InitInstance(Instance);
+
+		const AnimationClip& clip = Clips[Instance.Clip];
+		float TimeInTicks = Time * clip.TicksPerSecond;
+		float AnimationTime = clip.EndTime > 0.0f ? fmod(TimeInTicks, clip.EndTime) : 0.0f;
+
+		Instance.Cursor.KeysScanned = 0;
+		SampleChannels(clip, AnimationTime, Instance);
+		Instance.MarkPosed();
+	}
+
+	void EvaluateHierarchy(AnimationInstance& Instance) const
+	{
+		if(Clips.empty())
+			return;
+
+		if(m_UseHierarchyKernel)
 		{
-			unsigned int numPosKeys = scene->mAnimations[0]->mChannels[0]->mNumPositionKeys; /*here*/
-			float TicksPerSecond = scene->mAnimations[0]->mTicksPerSecond != 0 ? scene->mAnimations[0]->mTicksPerSecond : 25.0f;
-			float TimeInTicks = TimeInSeconds * TicksPerSecond;
-			float AnimationTime = fmod(TimeInTicks, scene->mAnimations[0]->mChannels[0]->mPositionKeys[numPosKeys - 1].mTime);
-	
-			ReadNodeHeirarchy(scene, AnimationTime, scene->mRootNode, IdentityDQ);
-	
-			Transforms.resize(m_NumBones);
-			
-			dqs.resize(m_NumBones);
-	
-			for (size_t i = 0; i < dqs.size(); ++i)
+			const HierarchyStream& Stream = m_Bindings[Instance.Clip].HierarchyStreams[LODIndex(Instance)];
+			Stream.LoadParents(Instance.Mode, m_GlobalInverseTransform, InverseDQ, Instance.GlobalTransformsDQ, Instance.GlobalTransforms, &Instance.LaneGlobals[0]);
+			Stream.LoadLocals(Instance.LocalRotations, Instance.LocalTranslations, &Instance.LaneLocals[0]);
+			m_EvaluateLevels(Stream, Instance.Mode, &Instance.LaneLocals[0], &Instance.LaneGlobals[0]);
+			return;
+		}
+
+		const vector<unsigned int>& DynamicJoints = GetLOD(Instance).DynamicJoints;
+		if(Instance.Mode == SKINNING_DQ)
+			for(unsigned int i = 0; i < DynamicJoints.size(); i++)
+				EvaluateGlobalDQ(DynamicJoints[i], Instance);
+		else
+			for(unsigned int i = 0; i < DynamicJoints.size(); i++)
+				EvaluateGlobalMatrix(DynamicJoints[i], Instance);
+	}
+
+	void BuildPalette(AnimationInstance& Instance) const
+	{
+		if(Clips.empty())
+			return;
+
+		if(m_UseHierarchyKernel)
+		{
+			if(Instance.Palette.Size() > 0)
+				m_BuildPaletteLanes(m_Bindings[Instance.Clip].HierarchyStreams[LODIndex(Instance)], Instance.Mode, &Instance.LaneGlobals[0], Instance.Palette.Data());
+			return;
+		}
+
+		const vector<unsigned int>& DynamicBones = GetLOD(Instance).DynamicBones;
+		if(Instance.Mode == SKINNING_DQ)
+			for(unsigned int i = 0; i < DynamicBones.size(); i++)
+				BuildPaletteDQ(DynamicBones[i], Instance);
+		else
+			for(unsigned int i = 0; i < DynamicBones.size(); i++)
+				BuildPaletteMatrix(DynamicBones[i], Instance);
+	}
+
+	// Joint i as bound to the instance's clip: its channel and motion there.
+	const Joint& boundJoint(unsigned int i, const AnimationInstance& Instance) const
+	{
+		return m_Bindings[Instance.Clip].BoundSkeleton.Joints[i];
+	}
+
+	// The level Instance.LOD selects, clamped to the levels built, as bound
+	// to the instance's clip.
+	const SkeletonLOD& GetLOD(const AnimationInstance& Instance) const
+	{
+		return m_Bindings[Instance.Clip].LODs[LODIndex(Instance)];
+	}
+
+	unsigned int LODIndex(const AnimationInstance& Instance) const
+	{
+		return Instance.LOD < m_LODs.size() ? Instance.LOD : (unsigned int)m_LODs.size() - 1;
+	}
+
+	// Evaluates NumInstances instances on the pool, all in Palettes.Mode, and
+	// copies each palette into its slice of Palettes. The copy is kept
+	// because the instance's own palette is what keeps static bones valid
+	// between frames.
+	void EvaluateBatch(WorkerPool& Pool, AnimationInstance* pInstances, unsigned int NumInstances, PaletteBuffer& Palettes) const
+	{
+		Palettes.Resize(Palettes.Mode, NumInstances, m_NumBones);
+
+		unsigned int Grain = NumInstances / (Pool.NumThreads() * 8);
+		Pool.ParallelFor(NumInstances, Grain > 0 ? Grain : 1, [&](unsigned int Begin, unsigned int End)
+		{
+			for(unsigned int i = Begin; i < End; i++)
 			{
-				dqs[i] = IdentityDQ;
-				dqs[i] = m_BoneInfo[i].FinalTransformationDQ;
+				AnimationInstance& Instance = pInstances[i];
+				Instance.Mode = Palettes.Mode;
+				Evaluate(Instance);
+				CopyPalette(Instance.Palette, Palettes, Palettes.Offset(i));
 			}
-	
-			for (unsigned int i = 0; i < m_NumBones; i++)
+		});
+	}
+
+	// Copies an evaluated palette into its slice of Palettes.
+	void CopyPalette(const BonePalette& Palette, PaletteBuffer& Palettes, unsigned int Offset) const
+	{
+		if(Palette.Size() == 0)
+			return;
+
+		if(Palette.Mode == SKINNING_LBS)
+			memcpy(&Palettes.Matrices[Offset], &Palette.Matrices[0], m_NumBones * sizeof(mat4));
+		else if(Palette.Mode == SKINNING_AFFINE)
+			memcpy(&Palettes.Affine[Offset], &Palette.Affine[0], m_NumBones * sizeof(mat3x4));
+		else
+			memcpy(&Palettes.DualQuaternions[Offset], &Palette.DualQuaternions[0], m_NumBones * sizeof(mat2x4));
+	}
+
+	// Sizes the instance for this asset and evaluates the whole skeleton once
+	// with the clip's first keys, so static subtrees keep their global
+	// transforms and palette entries from then on.
+	void InitInstance(AnimationInstance& Instance) const
+	{
+		assert(Instance.Clip < Clips.size());
+		const AnimationClip& clip = Clips[Instance.Clip];
+		const ClipBinding& Binding = m_Bindings[Instance.Clip];
+		unsigned int NumJoints = m_Skeleton.NumJoints();
+
+		Instance.BoundClip = (int)Instance.Clip;
+		Instance.BoundMode = Instance.Mode;
+		Instance.Cursor.Reset((unsigned int)clip.Channels.size());
+		Instance.LocalRotations.assign(NumJoints, fquat(1.f, 0.f, 0.f, 0.f));
+		Instance.LocalTranslations.assign(NumJoints, vec3(0.0f));
+		Instance.GlobalTransforms.resize(Instance.Mode == SKINNING_DQ ? 0 : NumJoints);
+		Instance.GlobalTransformsDQ.resize(Instance.Mode == SKINNING_DQ ? NumJoints : 0);
+
+		unsigned int NumLanes = 1;
+		for(unsigned int l = 0; l < Binding.HierarchyStreams.size(); l++)
+			NumLanes = Binding.HierarchyStreams[l].NumLanes > NumLanes ? Binding.HierarchyStreams[l].NumLanes : NumLanes;
+		Instance.LaneLocals.assign(HIERARCHY_LOCAL_COMPONENTS * NumLanes, 0.0f);
+		Instance.LaneGlobals.assign(HIERARCHY_AFFINE_COMPONENTS * NumLanes, 0.0f);
+
+		BonePalette& Palette = Instance.Palette;
+		Palette.Mode = Instance.Mode;
+		Palette.Matrices.assign(Instance.Mode == SKINNING_LBS ? m_NumBones : 0, mat4(1.0f));
+		Palette.Affine.assign(Instance.Mode == SKINNING_AFFINE ? m_NumBones : 0, mat3x4(1.0f));
+		Palette.DualQuaternions.assign(Instance.Mode == SKINNING_DQ ? m_NumBones : 0, mat2x4_cast(IdentityDQ));
+
+		for(unsigned int i = 0; i < NumJoints; i++)
+		{
+			const Joint& joint = Binding.BoundSkeleton.Joints[i];
+			if(joint.Channel != INVALID_CHANNEL)
 			{
-				Transforms[i] = mat4(1.0f);
-				Transforms[i] = m_BoneInfo[i].FinalTransformation;
+				const ClipChannel& channel = clip.Channels[joint.Channel];
+				Instance.LocalRotations[i] = clip.Rotation(channel, 0);
+				Instance.LocalTranslations[i] = clip.Position(channel, 0);
 			}
+			EvaluateJoint(i, Instance);
 		}
 	}
 
@@ -114,17 +372,175 @@ private:
         }
 		
         directory = path.substr(0, path.find_last_of('/'));
+		loadScene();
+	}
 
+	void loadScene()
+	{
 		aiMatrix4x4 tp1 = scene->mRootNode->mTransformation;
-		m_GlobalInverseTransform = transpose(make_mat4(&tp1.a1));
+		m_GlobalInverseTransform = inverse(transpose(make_mat4(&tp1.a1)));
 
 		InverseDQ = fdualquat(quat_cast(m_GlobalInverseTransform), vec3(m_GlobalInverseTransform[3][0], m_GlobalInverseTransform[3][1], m_GlobalInverseTransform[3][2]));
 		if(InverseDQ.dual.w == -0)
 			InverseDQ.dual.w = 0;
 
         processNode(scene->mRootNode, scene);
+		loadAnimations(scene);
+
+		m_Skeleton.Build(scene->mRootNode, Bone_Mapping, nullptr);
+		buildSkeletonLODs();
+		matchInfluenceCounts();
+		if(!m_Headless)
+			for(unsigned int m = 0; m < meshes.size(); m++)
+				meshes[m].Upload();
+
+		m_SkinningStreams.resize(meshes.size());
+		for(unsigned int m = 0; m < meshes.size(); m++)
+			m_SkinningStreams[m].Build(meshes[m]);
+
+		m_SamplerISA = DetectSamplerISA();
+		m_InterpolateRotations = SelectRotationKernel(m_SamplerISA);
+		UseHierarchyKernel(true, m_SamplerISA);
+		UseSkinningKernel(m_SamplerISA);
+		cout << "SAMPLER::" << SamplerISAName(m_SamplerISA) << endl;
+
+		m_Bindings.resize(Clips.size());
+		for(unsigned int c = 0; c < Clips.size(); c++)
+			bindClip(c);
     }
 
+	// Resolves every joint's channel in clip c once, so sampling never looks
+	// a channel up by name, and builds the per-LOD joint lists and kernel
+	// layouts for the joints that clip moves.
+	void bindClip(ClipHandle c)
+	{
+		const AnimationClip& clip = Clips[c];
+		ClipBinding& Binding = m_Bindings[c];
+		Skeleton& skeleton = Binding.BoundSkeleton;
+		skeleton.Build(scene->mRootNode, Bone_Mapping, &clip);
+
+		// The global inverse undoes the root node, so it is folded into the
+		// root joint here, or per frame if the clip animates the root.
+		if(skeleton.NumJoints() > 0 && skeleton.Joints[0].Channel == INVALID_CHANNEL)
+			skeleton.Joints[0].SetLocalTransformation(m_GlobalInverseTransform * skeleton.Joints[0].LocalTransformation);
+
+		float Size = m_JointExtents.empty() ? 0.0f : m_JointExtents[0];
+		Binding.LODs.resize(m_LODs.size());
+		Binding.HierarchyStreams.resize(m_LODs.size());
+		for(unsigned int l = 0; l < m_LODs.size(); l++)
+		{
+			skeleton.BuildLOD(m_JointExtents, SKELETON_LOD_EXTENTS[l] * Size, m_NumBones, Binding.LODs[l]);
+			Binding.HierarchyStreams[l].Build(skeleton, Binding.LODs[l], m_BoneInfo);
+		}
+		if(clip.SharedTimeline)
+			Binding.Rotations.Build(clip, skeleton, Binding.LODs);
+
+		if(!m_LODs.empty())
+			cout << "CLIP::" << clip.Name << ": handle " << c << ", " << clip.Length() << " s, " << Binding.LODs[0].AnimatedJoints.size() << " animated, "
+				<< Binding.LODs[0].DynamicJoints.size() << " dynamic joints in " << Binding.HierarchyStreams[0].NumLevels << " levels" << endl;
+	}
+
+	// Measures how far each joint's subtree reaches into the mesh in the bind
+	// pose and culls, per level, the joints that reach less than a fraction
+	// of the whole model. Every level past 0 gets its own bone stream with
+	// the culled bones' weights folded into their retained ancestors.
+	void buildSkeletonLODs()
+	{
+		// Bind poses in mesh space: a bone's is the inverse of its offset, and
+		// a joint without a bone is placed from one of its children, which
+		// exist since only ancestors of bones are kept.
+		unsigned int NumJoints = m_Skeleton.NumJoints();
+		vector<mat4> BindGlobals(NumJoints);
+		vector<bool> Placed(NumJoints, false);
+		vector<vec3> BindPositions(NumJoints);
+		vector<int> BoneJoints(m_NumBones, INVALID_JOINT);
+		for(unsigned int i = NumJoints; i-- > 0; )
+		{
+			const Joint& joint = m_Skeleton.Joints[i];
+			if(joint.BoneIndex != INVALID_JOINT)
+			{
+				BindGlobals[i] = inverse(m_BoneInfo[joint.BoneIndex].offset);
+				Placed[i] = true;
+				BoneJoints[joint.BoneIndex] = (int)i;
+			}
+			BindPositions[i] = vec3(BindGlobals[i][3][0], BindGlobals[i][3][1], BindGlobals[i][3][2]);
+			if(joint.Parent != INVALID_JOINT && Placed[i] && !Placed[joint.Parent])
+			{
+				BindGlobals[joint.Parent] = BindGlobals[i] * inverse(joint.LocalTransformation);
+				Placed[joint.Parent] = true;
+			}
+		}
+
+		vector<float> Extents(NumJoints, 0.0f);
+		for(unsigned int m = 0; m < meshes.size(); m++)
+		{
+			const Mesh& mesh = meshes[m];
+			const BoneStream& data = mesh.vertexBoneData;
+			unsigned int Count = (unsigned int)min(mesh.vertices.size(), (size_t)data.Size());
+			for(unsigned int v = 0; v < Count; v++)
+				for(unsigned int k = 0; k < data.NumInfluences; k++)
+				{
+					unsigned int Bone = data.BoneID(v, k);
+					if(data.Weight(v, k) == 0.0f || Bone >= m_NumBones || BoneJoints[Bone] == INVALID_JOINT)
+						continue;
+					int j = BoneJoints[Bone];
+					Extents[j] = max(Extents[j], length(mesh.vertices[v].Position - BindPositions[j]));
+				}
+		}
+		for(unsigned int i = NumJoints; i-- > 1; )
+		{
+			int Parent = m_Skeleton.Joints[i].Parent;
+			if(Parent != INVALID_JOINT)
+				Extents[Parent] = max(Extents[Parent], Extents[i] + length(BindPositions[i] - BindPositions[Parent]));
+		}
+
+		m_JointExtents = Extents;
+		float Size = NumJoints > 0 ? Extents[0] : 0.0f;
+		m_LODs.resize(NUM_SKELETON_LODS);
+		for(unsigned int l = 0; l < NUM_SKELETON_LODS; l++)
+		{
+			SkeletonLOD& LOD = m_LODs[l];
+			m_Skeleton.BuildLOD(Extents, SKELETON_LOD_EXTENTS[l] * Size, m_NumBones, LOD);
+			cout << "SKELETON::LOD " << l << ": " << LOD.NumRetained << " of " << NumJoints << " joints" << endl;
+			if(l == 0)
+				continue;
+
+			for(unsigned int m = 0; m < meshes.size(); m++)
+			{
+				const BoneStream& Source = meshes[m].vertexBoneData;
+				vector<VertexBoneData> Folded(Source.Size());
+				for(unsigned int v = 0; v < Source.Size(); v++)
+					for(unsigned int k = 0; k < Source.NumInfluences; k++)
+						if(Source.Weight(v, k) != 0.0f)
+						{
+							unsigned int Bone = Source.BoneID(v, k);
+							Folded[v].MergeBoneData(Bone < m_NumBones ? LOD.BoneRemap[Bone] : Bone, Source.Weight(v, k));
+						}
+				for(unsigned int v = 0; v < Folded.size(); v++)
+					Folded[v].Limit(SKELETON_LOD_INFLUENCES[l], SKIN_WEIGHT_THRESHOLD);
+
+				BoneStream Stream;
+				Stream.Assign(Folded, BoneStream::Width(Folded, SKELETON_LOD_INFLUENCES[l]));
+				meshes[m].AddBoneLOD(Stream);
+			}
+		}
+	}
+
+	// Widens every mesh's bone stream of a skeletal LOD to the widest of
+	// them, so one shader variant draws the whole LOD.
+	void matchInfluenceCounts()
+	{
+		for(unsigned int l = 0; l < max(NumLODs(), 1u); l++)
+		{
+			unsigned int Width = 2;
+			for(unsigned int m = 0; m < meshes.size(); m++)
+				Width = max(Width, meshes[m].NumInfluences(l));
+			for(unsigned int m = 0; m < meshes.size(); m++)
+				if(meshes[m].NumInfluences(l) != Width)
+					meshes[m].BoneData(l).Widen(Width);
+		}
+	}
+
    void processNode(aiNode *node, const aiScene *scene)
     {
 		for(unsigned int i = 0; i < node->mNumMeshes; i++)
@@ -203,12 +619,17 @@ private:
         std::vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
         textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
 
-        return Mesh(vertices, indices, textures, m_BoneInfo, Bones);
+		BoneStream Stream;
+		Stream.Assign(Bones, BoneStream::Width(Bones, m_MaxInfluences));
+        return Mesh(vertices, indices, textures, m_BoneInfo, Stream, m_PackedVertices);
     }
 
     vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName)
     {
         vector<Texture> textures;
+        if(m_Headless)
+            return textures;
+
         for(unsigned int i = 0; i < mat->GetTextureCount(type); i++)
         {
             aiString str;
@@ -237,8 +658,11 @@ private:
         return textures;
     }
 
+	// Gathers every influence assimp has for the mesh's vertices, then keeps
+	// the m_MaxInfluences heaviest of each, pruned and renormalized.
 	void loadMeshBones(aiMesh *mesh, vector<VertexBoneData>& Bones) 
 	{
+		vector<vector<pair<float, unsigned int> > > Influences(mesh->mNumVertices);
 		for(unsigned int i = 0; i < mesh->mNumBones; i++) 
 		{	
 			unsigned int BoneIndex = 0;
@@ -254,6 +678,12 @@ private:
 				
 				m_BoneInfo[BoneIndex].offset = converttoMat4(tp1);
 
+				mat4& offset = m_BoneInfo[BoneIndex].offset;
+				fdualquat& offsetDQ = m_BoneInfo[BoneIndex].offsetDQ;
+				offsetDQ = normalize(fdualquat(normalize(quat_cast(offset)), vec3(offset[3][0], offset[3][1], offset[3][2])));
+				if(offsetDQ.dual.w == -0)
+					offsetDQ.dual.w = 0;
+
 				Bone_Mapping[BoneName] = BoneIndex;
 			}
 			else
@@ -261,152 +691,215 @@ private:
 			
 			for(unsigned int n = 0; n < mesh->mBones[i]->mNumWeights; n++)
 			{
-				unsigned int vid = mesh->mBones[i]->mWeights[n].mVertexId + NumVertices;
+				unsigned int vid = mesh->mBones[i]->mWeights[n].mVertexId;
 				float weight = mesh->mBones[i]->mWeights[n].mWeight;
-				Bones[vid].AddBoneData(BoneIndex, weight);
+				Influences[vid].push_back(make_pair(weight, BoneIndex));
 			}
-			loadAnimations(scene, BoneName, Animations);
 		}
+		for(unsigned int v = 0; v < mesh->mNumVertices; v++)
+			Bones[v + NumVertices].Assign(Influences[v], m_MaxInfluences, SKIN_WEIGHT_THRESHOLD);
 		NumVertices += mesh->mNumVertices;
 	}
 
-	void loadAnimations(const aiScene *scene, string BoneName, map<string, map<string, const aiNodeAnim*>>& animations)
+	void loadAnimations(const aiScene *scene)
 	{
+		Clips.resize(scene->mNumAnimations);
 		for(unsigned int i = 0; i < scene->mNumAnimations; i++)
 		{
-			const aiAnimation* pAnimation = scene->mAnimations[i];
-			string animName = pAnimation->mName.data; /*here*/
-			for(unsigned int j = 0; j < pAnimation->mNumChannels; j++)
+			Clips[i].Build(scene->mAnimations[i]);
+			if(!m_Compression.ReduceKeys && !m_Compression.Quantize)
+				continue;
+
+			Skeleton skeleton;
+			skeleton.Build(scene->mRootNode, Bone_Mapping, &Clips[i]);
+			ClipCompressionReport report = ClipCompressor::Compress(Clips[i], scene->mAnimations[i], skeleton, m_Compression.ForClip(Clips[i].Name));
+			CompressionReports.push_back(report);
+
+			cout << "CLIP::" << report.Name << ": " << report.SourceBytes << " bytes in assimp, " << report.RawBytes << " raw, "
+				<< report.CompressedBytes << " compressed, " << report.SourceKeys << " -> " << report.Keys << " keys, "
+				<< report.ConstantChannels << " constant channels, max error " << report.MaxErrorMM << " mm" << endl;
+			if(report.SourceSharedTimeline && !report.SharedTimeline)
+				cout << "CLIP::" << report.Name << ": lost its shared timeline in compression, sampling per channel" << endl;
+		}
+	}
+
+	// Samples the joints of the instance's LOD that move. On a shared
+	// timeline the rotations all go through the SIMD kernel at once.
+	// Rotation-only joints keep the translation set by InitInstance.
+	void SampleChannels(const AnimationClip& clip, float AnimationTime, AnimationInstance& Instance) const
+	{
+		AnimationCursor& Cursor = Instance.Cursor;
+		const vector<unsigned int>& AnimatedJoints = GetLOD(Instance).AnimatedJoints;
+		if(clip.SharedTimeline)
+		{
+			const float* pTimes = clip.SharedKeyTimes();
+			unsigned int Index = FindKey(AnimationTime, pTimes, clip.NumSharedKeys, Cursor.Timeline, Cursor.KeysScanned);
+			float DeltaTime = pTimes[Index + 1] - pTimes[Index];
+			float Factor = min((AnimationTime - pTimes[Index]) / DeltaTime, 1.0f);
+
+			const RotationStream& Stream = m_Bindings[Instance.Clip].Rotations;
+			unsigned int Count = Stream.LODCounts[LODIndex(Instance)];
+			if(Count > 0)
+				m_InterpolateRotations(Stream.Key(Index), Stream.Key(Index + 1), Stream.NumLanes, Count, Factor, &Stream.Joints[0], &Instance.LocalRotations[0]);
+
+			for(unsigned int i = 0; i < AnimatedJoints.size(); i++)
 			{
-				if(pAnimation->mChannels[j]->mNodeName.data == BoneName)
+				unsigned int JointIndex = AnimatedJoints[i];
+				const Joint& joint = boundJoint(JointIndex, Instance);
+				if(joint.Motion == JOINT_ANIMATED)
 				{
-					animations[animName][BoneName] = pAnimation->mChannels[j];
-					break;
+					const ClipChannel& channel = clip.Channels[joint.Channel];
+					vec3 Start = clip.Position(channel, Index);
+					vec3 End = clip.Position(channel, Index + 1);
+					Instance.LocalTranslations[JointIndex] = Start + Factor * (End - Start);
 				}
 			}
+			return;
+		}
+
+		for(unsigned int i = 0; i < AnimatedJoints.size(); i++)
+		{
+			unsigned int JointIndex = AnimatedJoints[i];
+			const Joint& joint = boundJoint(JointIndex, Instance);
+			const ClipChannel& channel = clip.Channels[joint.Channel];
+			ChannelCursor& ChannelHint = Cursor.Channels[joint.Channel];
+
+			CalcInterpolatedRotaion(Instance.LocalRotations[JointIndex], AnimationTime, clip, channel, ChannelHint, Cursor.KeysScanned);
+			if(joint.Motion == JOINT_ANIMATED)
+				CalcInterpolatedPosition(Instance.LocalTranslations[JointIndex], AnimationTime, clip, channel, ChannelHint, Cursor.KeysScanned);
 		}
 	}
 
-	void ReadNodeHeirarchy(const aiScene *scene, float AnimationTime, const aiNode* pNode, const glm::fdualquat& ParentDQ)
+	void EvaluateJoint(unsigned int i, AnimationInstance& Instance) const
 	{
-		string NodeName(pNode->mName.data);
-		const aiAnimation* pAnimation = scene->mAnimations[0];
-		mat4 NodeTransformation = mat4(1.0f);
-		aiMatrix4x4 tp1 = pNode->mTransformation;
-		NodeTransformation = make_mat4(&tp1.a1);
-		const aiNodeAnim* pNodeAnim = nullptr;
-		pNodeAnim = Animations[pAnimation->mName.data][NodeName];
-		
-		fdualquat NodeTransformationDQ = IdentityDQ;
-		if(pNodeAnim)
+		if(Instance.Mode == SKINNING_DQ)
 		{
-			aiQuaternion RotationQ;
-			CalcInterpolatedRotaion(RotationQ, AnimationTime, pNodeAnim);
-			glm::fquat rotationQ;
-			rotationQ.w = RotationQ.w;
-			rotationQ.x = RotationQ.x;
-			rotationQ.y = RotationQ.y;
-			rotationQ.z = RotationQ.z;
-
-			mat4 RotationM = toMat4(rotationQ);
-			
-			aiVector3D Translation;
-			CalcInterpolatedPosition(Translation, AnimationTime, pNodeAnim);
+			EvaluateGlobalDQ(i, Instance);
+			if(m_Skeleton.Joints[i].BoneIndex != INVALID_JOINT)
+				BuildPaletteDQ(i, Instance);
+		}
+		else
+		{
+			EvaluateGlobalMatrix(i, Instance);
+			if(m_Skeleton.Joints[i].BoneIndex != INVALID_JOINT)
+				BuildPaletteMatrix(i, Instance);
+		}
+	}
+
+	void EvaluateGlobalMatrix(unsigned int i, AnimationInstance& Instance) const
+	{
+		const Joint& joint = boundJoint(i, Instance);
+		mat4 NodeTransformation = joint.LocalTransformation;
+
+		if(joint.Channel != INVALID_CHANNEL)
+		{
+			mat4 RotationM = toMat4(Instance.LocalRotations[i]);
 			mat4 TranslationM = mat4(1.0f);
-			TranslationM = translate(TranslationM, vec3(Translation.x, Translation.y, Translation.z));
+			TranslationM = translate(TranslationM, Instance.LocalTranslations[i]);
 			NodeTransformation = TranslationM * RotationM;
-			NodeTransformationDQ = normalize(fdualquat(rotationQ, vec3(Translation.x, Translation.y, Translation.z)));
-			if(NodeTransformationDQ.dual.w == -0)
-				NodeTransformationDQ.dual.w = 0;
+
+			if(joint.Parent == INVALID_JOINT)
+				NodeTransformation = m_GlobalInverseTransform * NodeTransformation;
 		}
 
 		mat4 GlobalTransformation = NodeTransformation;
-		fdualquat GlobalTransformationDQ = normalize(ParentDQ * NodeTransformationDQ);
-		if(GlobalTransformationDQ.dual.w == -0)
-			GlobalTransformationDQ.dual.w = 0;
-			
-		if(Bone_Mapping.find(NodeName) != Bone_Mapping.end())
-		{
-			unsigned int NodeIndex = Bone_Mapping[NodeName];
+		if(joint.Parent != INVALID_JOINT)
+			GlobalTransformation = Instance.GlobalTransforms[joint.Parent] * NodeTransformation;
+		Instance.GlobalTransforms[i] = GlobalTransformation;
+	}
 
-			m_BoneInfo[NodeIndex].FinalTransformation = m_GlobalInverseTransform * GlobalTransformation * m_BoneInfo[NodeIndex].offset;
+	void BuildPaletteMatrix(unsigned int i, AnimationInstance& Instance) const
+	{
+		const Joint& joint = m_Skeleton.Joints[i];
+		mat4 FinalTransformation = Instance.GlobalTransforms[i] * m_BoneInfo[joint.BoneIndex].offset;
+		if(Instance.Mode == SKINNING_AFFINE)
+			Instance.Palette.Affine[joint.BoneIndex] = mat3x4(transpose(FinalTransformation));
+		else
+			Instance.Palette.Matrices[joint.BoneIndex] = FinalTransformation;
+	}
 
-			fdualquat offsetDQ = normalize(fdualquat(normalize(quat_cast(m_BoneInfo[NodeIndex].offset)), vec3(m_BoneInfo[NodeIndex].offset[3][0], m_BoneInfo[NodeIndex].offset[3][1], m_BoneInfo[NodeIndex].offset[3][2])));
-			if(offsetDQ.dual.w == -0)
-				offsetDQ.dual.w = 0;
+	void EvaluateGlobalDQ(unsigned int i, AnimationInstance& Instance) const
+	{
+		const Joint& joint = boundJoint(i, Instance);
+		fdualquat NodeTransformationDQ = normalize(fdualquat(joint.LocalRotation, joint.LocalTranslation));
 
-			m_BoneInfo[NodeIndex].FinalTransformationDQ = normalize(IdentityDQ * GlobalTransformationDQ * offsetDQ);
-			if(m_BoneInfo[NodeIndex].FinalTransformationDQ.dual.w == -0)
-				m_BoneInfo[NodeIndex].FinalTransformationDQ.dual.w = 0;
+		if(joint.Channel != INVALID_CHANNEL)
+		{
+			NodeTransformationDQ = normalize(fdualquat(Instance.LocalRotations[i], Instance.LocalTranslations[i]));
+			if(joint.Parent == INVALID_JOINT)
+				NodeTransformationDQ = InverseDQ * NodeTransformationDQ;
 		}
+		if(NodeTransformationDQ.dual.w == -0)
+			NodeTransformationDQ.dual.w = 0;
+
+		fdualquat GlobalTransformationDQ = NodeTransformationDQ;
+		if(joint.Parent != INVALID_JOINT)
+			GlobalTransformationDQ = Instance.GlobalTransformsDQ[joint.Parent] * NodeTransformationDQ;
+		GlobalTransformationDQ = normalize(GlobalTransformationDQ);
+		if(GlobalTransformationDQ.dual.w == -0)
+			GlobalTransformationDQ.dual.w = 0;
+		Instance.GlobalTransformsDQ[i] = GlobalTransformationDQ;
+	}
 
-		for(unsigned int i = 0; i < pNode->mNumChildren; i++)
-			ReadNodeHeirarchy(scene, AnimationTime, pNode->mChildren[i], GlobalTransformationDQ);
+	void BuildPaletteDQ(unsigned int i, AnimationInstance& Instance) const
+	{
+		const Joint& joint = m_Skeleton.Joints[i];
+		fdualquat FinalTransformationDQ = normalize(Instance.GlobalTransformsDQ[i] * m_BoneInfo[joint.BoneIndex].offsetDQ);
+		if(FinalTransformationDQ.dual.w == -0)
+			FinalTransformationDQ.dual.w = 0;
+		Instance.Palette.DualQuaternions[joint.BoneIndex] = mat2x4_cast(FinalTransformationDQ);
 	}
 
-	void CalcInterpolatedRotaion(aiQuaternion& Out, float AnimationTime, const aiNodeAnim* pNodeAnim)
+	void CalcInterpolatedRotaion(fquat& Out, float AnimationTime, const AnimationClip& clip, const ClipChannel& channel, ChannelCursor& Cursor, unsigned int& KeysScanned) const
 	{
-		if(pNodeAnim->mNumRotationKeys == 1)
+		if(channel.NumRotationKeys == 1)
 		{
-			Out = pNodeAnim->mRotationKeys[0].mValue;
+			Out = clip.Rotation(channel, 0);
 			return;
 		}
 
-		unsigned int RotationIndex = FindRotation(AnimationTime, pNodeAnim);
+		const float* pTimes = clip.RotationTimes(channel);
+		unsigned int RotationIndex = FindRotation(AnimationTime, clip, channel, Cursor, KeysScanned);
 		unsigned int NextRotationIndex = (RotationIndex + 1);
-		assert(NextRotationIndex < pNodeAnim->mNumRotationKeys);
-		float DeltaTime = (float)(pNodeAnim->mRotationKeys[NextRotationIndex].mTime - pNodeAnim->mRotationKeys[RotationIndex].mTime);
-		float Factor = (AnimationTime - (float)pNodeAnim->mRotationKeys[RotationIndex].mTime) / DeltaTime;
+		assert(NextRotationIndex < channel.NumRotationKeys);
+		float DeltaTime = pTimes[NextRotationIndex] - pTimes[RotationIndex];
+		float Factor = min((AnimationTime - pTimes[RotationIndex]) / DeltaTime, 1.0f);
 		assert(Factor >= 0.0f && Factor <= 1.0f);
-		const aiQuaternion& StartRotationQ = pNodeAnim->mRotationKeys[RotationIndex].mValue;
-		const aiQuaternion& EndRotationQ = pNodeAnim->mRotationKeys[NextRotationIndex].mValue;
-		aiQuaternion::Interpolate(Out, StartRotationQ, EndRotationQ, Factor);
-		Out = Out.Normalize();
+		Out = InterpolateRotation(clip.Rotation(channel, RotationIndex), clip.Rotation(channel, NextRotationIndex), Factor);
 	}
 
-	void CalcInterpolatedPosition(aiVector3D& Out, float AnimationTime, const aiNodeAnim* pNodeAnim)
+	void CalcInterpolatedPosition(vec3& Out, float AnimationTime, const AnimationClip& clip, const ClipChannel& channel, ChannelCursor& Cursor, unsigned int& KeysScanned) const
 	{	
-		if (pNodeAnim->mNumPositionKeys == 1)
+		if (channel.NumPositionKeys == 1)
 		{
-			Out = pNodeAnim->mPositionKeys[0].mValue;
+			Out = clip.Position(channel, 0);
 			return;
 		}
 
-		unsigned int PositionIndex = FindPosition(AnimationTime, pNodeAnim);
+		const float* pTimes = clip.PositionTimes(channel);
+		unsigned int PositionIndex = FindPosition(AnimationTime, clip, channel, Cursor, KeysScanned);
 		unsigned int NextPositionIndex = (PositionIndex + 1);
-		assert(NextPositionIndex < pNodeAnim->mNumPositionKeys);
-		float DeltaTime = (float)(pNodeAnim->mPositionKeys[NextPositionIndex].mTime - pNodeAnim->mPositionKeys[PositionIndex].mTime);
-		float Factor = (AnimationTime - (float)pNodeAnim->mPositionKeys[PositionIndex].mTime) / DeltaTime;
+		assert(NextPositionIndex < channel.NumPositionKeys);
+		float DeltaTime = pTimes[NextPositionIndex] - pTimes[PositionIndex];
+		float Factor = min((AnimationTime - pTimes[PositionIndex]) / DeltaTime, 1.0f);
 		assert(Factor >= 0.0f && Factor <= 1.0f);
-		const aiVector3D& Start = pNodeAnim->mPositionKeys[PositionIndex].mValue;
-		const aiVector3D& End = pNodeAnim->mPositionKeys[NextPositionIndex].mValue;
-		aiVector3D Delta = End - Start;
-		Out = Start + Factor * Delta;
+		vec3 Start = clip.Position(channel, PositionIndex);
+		vec3 End = clip.Position(channel, NextPositionIndex);
+		Out = Start + Factor * (End - Start);
 	}
 
-	unsigned int FindRotation(float AnimationTime, const aiNodeAnim* pNodeAnim)
+	unsigned int FindRotation(float AnimationTime, const AnimationClip& clip, const ClipChannel& channel, ChannelCursor& Cursor, unsigned int& KeysScanned) const
 	{
-		assert(pNodeAnim->mNumRotationKeys > 0);
-
-		for(unsigned int i = 0; i < pNodeAnim->mNumRotationKeys - 1; i++)
-		{
-			if(AnimationTime < (float)pNodeAnim->mRotationKeys[i + 1].mTime)
-				return i;
-		}
+		assert(channel.NumRotationKeys > 0);
 
-		assert(0);
-		return 0;
+		return FindKey(AnimationTime, clip.RotationTimes(channel), channel.NumRotationKeys, Cursor.Rotation, KeysScanned);
 	}
 
-	unsigned int FindPosition(float AnimationTime, const aiNodeAnim* pNodeAnim)
+	unsigned int FindPosition(float AnimationTime, const AnimationClip& clip, const ClipChannel& channel, ChannelCursor& Cursor, unsigned int& KeysScanned) const
 	{
-		for(unsigned int i = 0; i < pNodeAnim->mNumPositionKeys - 1; i++)
-		{
-			if(AnimationTime < (float)pNodeAnim->mPositionKeys[i + 1].mTime)
-				return i;
-		}
-		assert(0);
-		return 0;
+		assert(channel.NumPositionKeys > 0);
+
+		return FindKey(AnimationTime, clip.PositionTimes(channel), channel.NumPositionKeys, Cursor.Position, KeysScanned);
 	}
 
 };
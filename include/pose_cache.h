@@ -0,0 +1,118 @@
+#ifndef POSE_CACHE_H
+#define POSE_CACHE_H
+
+#include "skinning.h"
+
+#include <cmath>
+#include <map>
+using namespace std;
+
+// What makes two palettes equal: same clip sampled at the same quantized
+// time, for the same skeletal LOD and skinning mode.
+struct PoseKey
+{
+	unsigned int Clip;
+	unsigned int Tick;
+	unsigned int LOD;
+	SkinningMode Mode;
+
+	bool operator<(const PoseKey& Other) const
+	{
+		if(Clip != Other.Clip)
+			return Clip < Other.Clip;
+		if(Tick != Other.Tick)
+			return Tick < Other.Tick;
+		if(LOD != Other.LOD)
+			return LOD < Other.LOD;
+		return Mode < Other.Mode;
+	}
+};
+
+// Frame-scoped map from PoseKey to the first instance that asked for it.
+// That instance evaluates the pose at KeyTime; every later instance with the
+// same key is a hit and copies its palette instead of evaluating. Lookups
+// happen on one thread before evaluation is scheduled, so there is no
+// locking. A Step of 0 disables sharing.
+class PoseCache
+{
+public:
+	// Quantization step in seconds.
+	float Step;
+	// This frame's lookups, and all lookups since construction.
+	unsigned int Hits;
+	unsigned int Misses;
+	unsigned long long TotalHits;
+	unsigned long long TotalMisses;
+
+	PoseCache(float step = 1.0f / 60.0f)
+	{
+		Step = step;
+		Hits = 0;
+		Misses = 0;
+		TotalHits = 0;
+		TotalMisses = 0;
+	}
+
+	void BeginFrame()
+	{
+		m_Owners.clear();
+		Hits = 0;
+		Misses = 0;
+	}
+
+	// Length is the clip length in seconds; Time is wrapped to it the way
+	// SkinnedModelAsset::Sample does.
+	PoseKey MakeKey(unsigned int Clip, float Length, float Time, unsigned int LOD, SkinningMode Mode) const
+	{
+		PoseKey Key;
+		Key.Clip = Clip;
+		Key.Tick = 0;
+		Key.LOD = LOD;
+		Key.Mode = Mode;
+
+		if(Step > 0.0f && Length > 0.0f)
+		{
+			float Local = fmod(Time, Length);
+			if(Local < 0.0f)
+				Local += Length;
+			Key.Tick = (unsigned int)floor(Local / Step + 0.5f);
+			if(Key.Tick * Step >= Length)
+				Key.Tick = 0;
+		}
+		return Key;
+	}
+
+	float KeyTime(const PoseKey& Key) const
+	{
+		return Key.Tick * Step;
+	}
+
+	// Returns the instance that owns Key this frame, making Instance the
+	// owner if nobody does yet.
+	unsigned int Find(const PoseKey& Key, unsigned int Instance)
+	{
+		if(Step <= 0.0f)
+		{
+			Misses++;
+			TotalMisses++;
+			return Instance;
+		}
+
+		pair<map<PoseKey, unsigned int>::iterator, bool> Entry = m_Owners.insert(make_pair(Key, Instance));
+		if(Entry.second)
+		{
+			Misses++;
+			TotalMisses++;
+		}
+		else
+		{
+			Hits++;
+			TotalHits++;
+		}
+		return Entry.first->second;
+	}
+
+private:
+	map<PoseKey, unsigned int> m_Owners;
+};
+#endif
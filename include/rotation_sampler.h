@@ -0,0 +1,269 @@
+#ifndef ROTATION_SAMPLER_H
+#define ROTATION_SAMPLER_H
+
+#include <glm/glm.hpp>
+#include <glm\gtx\quaternion.hpp>
+
+#include "animation.h"
+#include "skeleton.h"
+
+#include <vector>
+using namespace std;
+using namespace glm;
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SAMPLER_SSE 1
+#include <emmintrin.h>
+#endif
+
+#if defined(SAMPLER_SSE) && defined(__GNUC__)
+#define SAMPLER_AVX 1
+#define SAMPLER_AVX_TARGET __attribute__((target("avx")))
+#include <immintrin.h>
+#elif defined(SAMPLER_SSE) && defined(_MSC_VER)
+#define SAMPLER_AVX 1
+#define SAMPLER_AVX_TARGET
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+// Lanes per SoA group; streams are padded to a multiple of this so the AVX
+// kernel never needs a remainder loop.
+#define SAMPLER_LANES 8
+
+enum SamplerISA
+{
+	SAMPLER_ISA_SCALAR,
+	SAMPLER_ISA_SSE,
+	SAMPLER_ISA_AVX
+};
+
+inline const char* SamplerISAName(SamplerISA ISA)
+{
+	if(ISA == SAMPLER_ISA_AVX)
+		return "avx";
+	if(ISA == SAMPLER_ISA_SSE)
+		return "sse";
+	return "scalar";
+}
+
+// Best kernel this CPU runs.
+inline SamplerISA DetectSamplerISA()
+{
+#if defined(SAMPLER_AVX) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx"))
+		return SAMPLER_ISA_AVX;
+#elif defined(SAMPLER_AVX) && defined(_MSC_VER)
+	int Info[4];
+	__cpuid(Info, 1);
+	bool OSSavesYMM = (Info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+	if(OSSavesYMM && (Info[2] & (1 << 28)))
+		return SAMPLER_ISA_AVX;
+#endif
+#ifdef SAMPLER_SSE
+	return SAMPLER_ISA_SSE;
+#else
+	return SAMPLER_ISA_SCALAR;
+#endif
+}
+
+// The rotation keys of one clip in structure-of-arrays form: for key k,
+// component c (x, y, z, w) and lane l the value is at
+// Values[(k * 4 + c) * NumLanes + l]. Lane l belongs to Joints[l]; lanes
+// past Joints.size() are padding with identity rotations. Joints are
+// ordered coarsest skeletal LOD first, and LODs keep a subset of the joints
+// of finer ones, so LOD l samples the first LODCounts[l] lanes. Only built
+// for clips on a shared timeline, where every lane brackets the same key
+// pair.
+struct RotationStream
+{
+	vector<unsigned int> Joints;
+	vector<unsigned int> LODCounts;
+	unsigned int NumLanes;
+	unsigned int NumKeys;
+	vector<float> Values;
+
+	RotationStream()
+	{
+		NumLanes = 0;
+		NumKeys = 0;
+	}
+
+	void Build(const AnimationClip& clip, const Skeleton& skeleton, const vector<SkeletonLOD>& LODs)
+	{
+		Joints.clear();
+		LODCounts.assign(LODs.size(), 0);
+		vector<bool> Added(skeleton.NumJoints(), false);
+		for(unsigned int l = (unsigned int)LODs.size(); l-- > 0; )
+		{
+			const vector<unsigned int>& AnimatedJoints = LODs[l].AnimatedJoints;
+			for(unsigned int i = 0; i < AnimatedJoints.size(); i++)
+				if(!Added[AnimatedJoints[i]])
+				{
+					Added[AnimatedJoints[i]] = true;
+					Joints.push_back(AnimatedJoints[i]);
+				}
+			LODCounts[l] = (unsigned int)Joints.size();
+		}
+		NumLanes = ((unsigned int)Joints.size() + SAMPLER_LANES - 1) / SAMPLER_LANES * SAMPLER_LANES;
+		NumKeys = clip.SharedTimeline ? clip.NumSharedKeys : 0;
+		Values.assign(NumKeys * 4 * NumLanes, 0.0f);
+
+		for(unsigned int k = 0; k < NumKeys; k++)
+			for(unsigned int l = 0; l < NumLanes; l++)
+			{
+				fquat q(1.f, 0.f, 0.f, 0.f);
+				if(l < Joints.size())
+					q = clip.Rotation(clip.Channels[skeleton.Joints[Joints[l]].Channel], k);
+				float* pKey = Key(k);
+				pKey[0 * NumLanes + l] = q.x;
+				pKey[1 * NumLanes + l] = q.y;
+				pKey[2 * NumLanes + l] = q.z;
+				pKey[3 * NumLanes + l] = q.w;
+			}
+	}
+
+	float* Key(unsigned int k)
+	{
+		return &Values[k * 4 * NumLanes];
+	}
+
+	const float* Key(unsigned int k) const
+	{
+		return &Values[k * 4 * NumLanes];
+	}
+};
+
+// Interpolates every lane of two SoA keys by Factor and writes lane l to
+// pOut[pJoints[l]] for the first Count lanes. All kernels do the arithmetic
+// of InterpolateRotation in the same order, so they agree bit for bit.
+typedef void (*RotationKernel)(const float* pStart, const float* pEnd, unsigned int NumLanes, unsigned int Count, float Factor, const unsigned int* pJoints, fquat* pOut);
+
+inline void InterpolateRotationsScalar(const float* pStart, const float* pEnd, unsigned int NumLanes, unsigned int Count, float Factor, const unsigned int* pJoints, fquat* pOut)
+{
+	for(unsigned int l = 0; l < Count; l++)
+	{
+		fquat Start(pStart[3 * NumLanes + l], pStart[l], pStart[NumLanes + l], pStart[2 * NumLanes + l]);
+		fquat End(pEnd[3 * NumLanes + l], pEnd[l], pEnd[NumLanes + l], pEnd[2 * NumLanes + l]);
+		pOut[pJoints[l]] = InterpolateRotation(Start, End, Factor);
+	}
+}
+
+#ifdef SAMPLER_SSE
+inline void InterpolateRotationsSSE(const float* pStart, const float* pEnd, unsigned int NumLanes, unsigned int Count, float Factor, const unsigned int* pJoints, fquat* pOut)
+{
+	float Half = Factor - 0.5f;
+	float Cubic = Factor * Half * (Factor - 1.0f);
+	__m128 t = _mm_set1_ps(Factor);
+	__m128 h2 = _mm_set1_ps(Half * Half);
+	__m128 c = _mm_set1_ps(Cubic);
+	__m128 Zero = _mm_setzero_ps();
+	__m128 SignBit = _mm_set1_ps(-0.0f);
+	__m128 One = _mm_set1_ps(1.0f);
+
+	for(unsigned int Base = 0; Base < Count; Base += 4)
+	{
+		__m128 ax = _mm_loadu_ps(pStart + Base), ay = _mm_loadu_ps(pStart + NumLanes + Base);
+		__m128 az = _mm_loadu_ps(pStart + 2 * NumLanes + Base), aw = _mm_loadu_ps(pStart + 3 * NumLanes + Base);
+		__m128 bx = _mm_loadu_ps(pEnd + Base), by = _mm_loadu_ps(pEnd + NumLanes + Base);
+		__m128 bz = _mm_loadu_ps(pEnd + 2 * NumLanes + Base), bw = _mm_loadu_ps(pEnd + 3 * NumLanes + Base);
+
+		__m128 d = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz)), _mm_mul_ps(aw, bw));
+		__m128 Flip = _mm_and_ps(_mm_cmplt_ps(d, Zero), SignBit);
+		d = _mm_xor_ps(d, Flip);
+		bx = _mm_xor_ps(bx, Flip);
+		by = _mm_xor_ps(by, Flip);
+		bz = _mm_xor_ps(bz, Flip);
+		bw = _mm_xor_ps(bw, Flip);
+
+		__m128 A = _mm_add_ps(_mm_set1_ps(1.0904f), _mm_mul_ps(d, _mm_add_ps(_mm_set1_ps(-3.2452f), _mm_mul_ps(d, _mm_sub_ps(_mm_set1_ps(3.55645f), _mm_mul_ps(d, _mm_set1_ps(1.43519f)))))));
+		__m128 B = _mm_add_ps(_mm_set1_ps(0.848013f), _mm_mul_ps(d, _mm_add_ps(_mm_set1_ps(-1.06021f), _mm_mul_ps(d, _mm_set1_ps(0.215638f)))));
+		__m128 k = _mm_add_ps(_mm_mul_ps(A, h2), B);
+		__m128 ot = _mm_add_ps(t, _mm_mul_ps(c, k));
+		__m128 u = _mm_sub_ps(One, ot);
+
+		__m128 rx = _mm_add_ps(_mm_mul_ps(ax, u), _mm_mul_ps(bx, ot));
+		__m128 ry = _mm_add_ps(_mm_mul_ps(ay, u), _mm_mul_ps(by, ot));
+		__m128 rz = _mm_add_ps(_mm_mul_ps(az, u), _mm_mul_ps(bz, ot));
+		__m128 rw = _mm_add_ps(_mm_mul_ps(aw, u), _mm_mul_ps(bw, ot));
+		__m128 Length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rx, rx), _mm_mul_ps(ry, ry)), _mm_mul_ps(rz, rz)), _mm_mul_ps(rw, rw)));
+
+		float Out[4][4];
+		_mm_storeu_ps(Out[0], _mm_div_ps(rx, Length));
+		_mm_storeu_ps(Out[1], _mm_div_ps(ry, Length));
+		_mm_storeu_ps(Out[2], _mm_div_ps(rz, Length));
+		_mm_storeu_ps(Out[3], _mm_div_ps(rw, Length));
+
+		unsigned int Lanes = Count - Base < 4 ? Count - Base : 4;
+		for(unsigned int l = 0; l < Lanes; l++)
+			pOut[pJoints[Base + l]] = fquat(Out[3][l], Out[0][l], Out[1][l], Out[2][l]);
+	}
+}
+#endif
+
+#ifdef SAMPLER_AVX
+SAMPLER_AVX_TARGET inline void InterpolateRotationsAVX(const float* pStart, const float* pEnd, unsigned int NumLanes, unsigned int Count, float Factor, const unsigned int* pJoints, fquat* pOut)
+{
+	float Half = Factor - 0.5f;
+	float Cubic = Factor * Half * (Factor - 1.0f);
+	__m256 t = _mm256_set1_ps(Factor);
+	__m256 h2 = _mm256_set1_ps(Half * Half);
+	__m256 c = _mm256_set1_ps(Cubic);
+	__m256 Zero = _mm256_setzero_ps();
+	__m256 SignBit = _mm256_set1_ps(-0.0f);
+	__m256 One = _mm256_set1_ps(1.0f);
+
+	for(unsigned int Base = 0; Base < Count; Base += 8)
+	{
+		__m256 ax = _mm256_loadu_ps(pStart + Base), ay = _mm256_loadu_ps(pStart + NumLanes + Base);
+		__m256 az = _mm256_loadu_ps(pStart + 2 * NumLanes + Base), aw = _mm256_loadu_ps(pStart + 3 * NumLanes + Base);
+		__m256 bx = _mm256_loadu_ps(pEnd + Base), by = _mm256_loadu_ps(pEnd + NumLanes + Base);
+		__m256 bz = _mm256_loadu_ps(pEnd + 2 * NumLanes + Base), bw = _mm256_loadu_ps(pEnd + 3 * NumLanes + Base);
+
+		__m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, bx), _mm256_mul_ps(ay, by)), _mm256_mul_ps(az, bz)), _mm256_mul_ps(aw, bw));
+		__m256 Flip = _mm256_and_ps(_mm256_cmp_ps(d, Zero, _CMP_LT_OQ), SignBit);
+		d = _mm256_xor_ps(d, Flip);
+		bx = _mm256_xor_ps(bx, Flip);
+		by = _mm256_xor_ps(by, Flip);
+		bz = _mm256_xor_ps(bz, Flip);
+		bw = _mm256_xor_ps(bw, Flip);
+
+		__m256 A = _mm256_add_ps(_mm256_set1_ps(1.0904f), _mm256_mul_ps(d, _mm256_add_ps(_mm256_set1_ps(-3.2452f), _mm256_mul_ps(d, _mm256_sub_ps(_mm256_set1_ps(3.55645f), _mm256_mul_ps(d, _mm256_set1_ps(1.43519f)))))));
+		__m256 B = _mm256_add_ps(_mm256_set1_ps(0.848013f), _mm256_mul_ps(d, _mm256_add_ps(_mm256_set1_ps(-1.06021f), _mm256_mul_ps(d, _mm256_set1_ps(0.215638f)))));
+		__m256 k = _mm256_add_ps(_mm256_mul_ps(A, h2), B);
+		__m256 ot = _mm256_add_ps(t, _mm256_mul_ps(c, k));
+		__m256 u = _mm256_sub_ps(One, ot);
+
+		__m256 rx = _mm256_add_ps(_mm256_mul_ps(ax, u), _mm256_mul_ps(bx, ot));
+		__m256 ry = _mm256_add_ps(_mm256_mul_ps(ay, u), _mm256_mul_ps(by, ot));
+		__m256 rz = _mm256_add_ps(_mm256_mul_ps(az, u), _mm256_mul_ps(bz, ot));
+		__m256 rw = _mm256_add_ps(_mm256_mul_ps(aw, u), _mm256_mul_ps(bw, ot));
+		__m256 Length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rx, rx), _mm256_mul_ps(ry, ry)), _mm256_mul_ps(rz, rz)), _mm256_mul_ps(rw, rw)));
+
+		float Out[4][8];
+		_mm256_storeu_ps(Out[0], _mm256_div_ps(rx, Length));
+		_mm256_storeu_ps(Out[1], _mm256_div_ps(ry, Length));
+		_mm256_storeu_ps(Out[2], _mm256_div_ps(rz, Length));
+		_mm256_storeu_ps(Out[3], _mm256_div_ps(rw, Length));
+
+		unsigned int Lanes = Count - Base < 8 ? Count - Base : 8;
+		for(unsigned int l = 0; l < Lanes; l++)
+			pOut[pJoints[Base + l]] = fquat(Out[3][l], Out[0][l], Out[1][l], Out[2][l]);
+	}
+}
+#endif
+
+inline RotationKernel SelectRotationKernel(SamplerISA ISA)
+{
+#ifdef SAMPLER_AVX
+	if(ISA == SAMPLER_ISA_AVX)
+		return InterpolateRotationsAVX;
+#endif
+#ifdef SAMPLER_SSE
+	if(ISA != SAMPLER_ISA_SCALAR)
+		return InterpolateRotationsSSE;
+#endif
+	return InterpolateRotationsScalar;
+}
+#endif
@@ -4,7 +4,10 @@
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 
+#include "vertex_layout.h"
+
 #include <string>
+#include <map>
 #include <fstream>
 #include <sstream>
 #include <iostream>
@@ -14,7 +17,9 @@ class Shader
 public:
     unsigned int ID;
 	
-    Shader(const char* vertexPath, const char* fragmentPath)
+    // defines ("#define NAME VALUE" lines) go right after each stage's
+    // #version line, to build variants of one source.
+    Shader(const char* vertexPath, const char* fragmentPath, const std::string& defines = "")
     {
         std::string vertexCode;
         std::string fragmentCode;
@@ -35,8 +40,8 @@ public:
             vShaderFile.close();
             fShaderFile.close();
 			
-            vertexCode = vShaderStream.str();
-            fragmentCode = fShaderStream.str();
+            vertexCode = injectDefines(vShaderStream.str(), defines);
+            fragmentCode = injectDefines(fShaderStream.str(), defines);
         }
         catch (std::ifstream::failure& e)
         {
@@ -59,11 +64,9 @@ public:
 
         ID = glCreateProgram();
         
-		glBindAttribLocation(ID, 0, "aPos");
-		glBindAttribLocation(ID, 1, "aNormal");
-		glBindAttribLocation(ID, 2, "aTexCoords");        
-		glBindAttribLocation(ID, 3, "BoneIDs");    
-		glBindAttribLocation(ID, 4, "BoneIDs");  
+#define BIND_VERTEX_ATTRIBUTE(Location, Name) glBindAttribLocation(ID, Location, Name);
+		VERTEX_ATTRIBUTE_NAMES(BIND_VERTEX_ATTRIBUTE)
+#undef BIND_VERTEX_ATTRIBUTE
         
         glAttachShader(ID, vertex);
         glAttachShader(ID, fragment);
@@ -72,76 +75,152 @@ public:
 		
         glDeleteShader(vertex);
         glDeleteShader(fragment);
+
+        cacheUniformLocations();
     }
 	
     void use() const
     {
         glUseProgram(ID);
     }
+
+    // Cached location of a uniform. Names that were not reported as active
+    // after link (single array elements past [0]) are looked up once.
+    GLint location(const std::string& name) const
+    {
+        std::map<std::string, GLint>::const_iterator it = uniformLocations.find(name);
+        if(it != uniformLocations.end())
+            return it->second;
+
+        GLint loc = glGetUniformLocation(ID, name.c_str());
+        uniformLocations[name] = loc;
+        return loc;
+    }
 	
     void setBool(const std::string& name, bool value) const
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+        glUniform1i(location(name), (int)value);
     }
     // ------------------------------------------------------------------------
     void setInt(const std::string& name, int value) const
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+        glUniform1i(location(name), value);
     }
     // ------------------------------------------------------------------------
     void setFloat(const std::string& name, float value) const
     {
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+        glUniform1f(location(name), value);
     }
     // ------------------------------------------------------------------------
     void setVec2(const std::string& name, const glm::vec2& value) const
     {
-        glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+        glUniform2fv(location(name), 1, &value[0]);
     }
     void setVec2(const std::string& name, float x, float y) const
     {
-        glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+        glUniform2f(location(name), x, y);
     }
     // ------------------------------------------------------------------------
     void setVec3(const std::string& name, const glm::vec3& value) const
     {
-        glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+        glUniform3fv(location(name), 1, &value[0]);
     }
     void setVec3(const std::string& name, float x, float y, float z) const
     {
-        glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+        glUniform3f(location(name), x, y, z);
     }
     // ------------------------------------------------------------------------
     void setVec4(const std::string& name, const glm::vec4& value) const
     {
-        glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+        glUniform4fv(location(name), 1, &value[0]);
     }
     void setVec4(const std::string& name, float x, float y, float z, float w) const
     {
-        glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+        glUniform4f(location(name), x, y, z, w);
     }
     // ------------------------------------------------------------------------
     void setMat2(const std::string& name, const glm::mat2& mat) const
     {
-        glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        glUniformMatrix2fv(location(name), 1, GL_FALSE, &mat[0][0]);
     }
     // ------------------------------------------------------------------------
     void setMat3(const std::string& name, const glm::mat3& mat) const
     {
-        glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        glUniformMatrix3fv(location(name), 1, GL_FALSE, &mat[0][0]);
     }
     // ------------------------------------------------------------------------
     void setMat4(const std::string& name, const glm::mat4& mat) const
     {
-        glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        glUniformMatrix4fv(location(name), 1, GL_FALSE, &mat[0][0]);
     }
     // ------------------------------------------------------------------------
 	void setMat2x4(const std::string &name, const glm::mat2x4 &mat) const
 	{
-		glUniformMatrix2x4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix2x4fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
+    // ------------------------------------------------------------------------
+	void setMat3x4(const std::string &name, const glm::mat3x4 &mat) const
+	{
+		glUniformMatrix3x4fv(location(name), 1, GL_FALSE, &mat[0][0]);
+	}
+    // ------------------------------------------------------------------------
+    // Whole-array uploads: count elements starting at name[0], in one call.
+    void setMat4Array(const std::string& name, const glm::mat4* mats, unsigned int count) const
+    {
+        glUniformMatrix4fv(location(name), count, GL_FALSE, &mats[0][0][0]);
+    }
+    void setMat3x4Array(const std::string& name, const glm::mat3x4* mats, unsigned int count) const
+    {
+        glUniformMatrix3x4fv(location(name), count, GL_FALSE, &mats[0][0][0]);
+    }
+    void setMat2x4Array(const std::string& name, const glm::mat2x4* mats, unsigned int count) const
+    {
+        glUniformMatrix2x4fv(location(name), count, GL_FALSE, &mats[0][0][0]);
+    }
 
 private:
+    mutable std::map<std::string, GLint> uniformLocations;
+
+    static std::string injectDefines(const std::string& code, const std::string& defines)
+    {
+        if(defines.empty())
+            return code;
+        std::string::size_type version = code.find("#version");
+        std::string::size_type line = version == std::string::npos ? 0 : code.find('\n', version);
+        if(line == std::string::npos)
+            return code + "\n" + defines;
+        if(version != std::string::npos)
+            line++;
+        return code.substr(0, line) + defines + code.substr(line);
+    }
+
+    // Reads every active uniform once after link. Arrays are reported as
+    // "name[0]" and are stored under "name" as well.
+    void cacheUniformLocations()
+    {
+        GLint count = 0;
+        GLint maxLength = 0;
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+        std::string name(maxLength > 0 ? maxLength : 1, '\0');
+        for(GLint i = 0; i < count; i++)
+        {
+            GLsizei length = 0;
+            GLint size = 0;
+            GLenum type = 0;
+            glGetActiveUniform(ID, (GLuint)i, (GLsizei)name.size(), &length, &size, &type, &name[0]);
+
+            std::string uniform(name.c_str(), length);
+            GLint loc = glGetUniformLocation(ID, uniform.c_str());
+            uniformLocations[uniform] = loc;
+
+            std::string::size_type bracket = uniform.find("[0]");
+            if(bracket != std::string::npos && bracket + 3 == uniform.size())
+                uniformLocations[uniform.substr(0, bracket)] = loc;
+        }
+    }
+
     void checkCompileErrors(GLuint shader, std::string type)
     {
         GLint success;
@@ -166,4 +245,28 @@ private:
         }
     }
 };
+
+// Programs built from vertex / fragment sources and a set of defines, each
+// compiled the first time it is asked for and kept for the cache's
+// lifetime. References stay valid as more programs are added.
+class ShaderCache
+{
+public:
+    const Shader& get(const char* vertexPath, const char* fragmentPath, const std::string& defines = "")
+    {
+        std::string key = std::string(vertexPath) + "\n" + fragmentPath + "\n" + defines;
+        std::map<std::string, Shader>::iterator it = programs.find(key);
+        if(it == programs.end())
+            it = programs.insert(std::make_pair(key, Shader(vertexPath, fragmentPath, defines))).first;
+        return it->second;
+    }
+
+    unsigned int size() const
+    {
+        return (unsigned int)programs.size();
+    }
+
+private:
+    std::map<std::string, Shader> programs;
+};
 #endif
\ No newline at end of file
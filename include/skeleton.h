@@ -0,0 +1,207 @@
+#ifndef SKELETON_H
+#define SKELETON_H
+
+#include <glm/glm.hpp>
+#include <glm\gtc\type_ptr.hpp>
+#include <glm\gtx\dual_quaternion.hpp>
+
+#include <assimp/scene.h>
+
+#include "animation.h"
+
+#include <string>
+#include <map>
+#include <vector>
+using namespace std;
+using namespace glm;
+
+#define INVALID_JOINT -1
+#define NUM_SKELETON_LODS 4
+
+// Per skeletal LOD, the smallest subtree extent kept, as a fraction of the
+// model's.
+const float SKELETON_LOD_EXTENTS[NUM_SKELETON_LODS] = { 0.0f, 0.05f, 0.1f, 0.2f };
+
+// Per skeletal LOD, the most influences a vertex keeps, never more than the
+// import kept. LOD 0 keeps what the import kept.
+const unsigned int SKELETON_LOD_INFLUENCES[NUM_SKELETON_LODS] = { 8, 4, 4, 2 };
+
+// How a joint's local transform changes over the clip. Static joints either
+// have no channel or one whose keys never change.
+enum JointMotion
+{
+	JOINT_STATIC,
+	JOINT_ROTATION_ONLY,
+	JOINT_ANIMATED
+};
+
+// One node of the flattened hierarchy. Joints are stored parent-before-child,
+// so a single forward pass over the array visits every parent first.
+struct Joint
+{
+	string Name;
+	int Parent;
+	int BoneIndex;
+	int Channel;
+	JointMotion Motion;
+	// Set when this joint or any ancestor moves, i.e. its global transform
+	// has to be recomputed every frame.
+	bool Dynamic;
+	mat4 LocalTransformation;
+	// LocalTransformation as a rotation and translation, what the dual
+	// quaternion path uses for joints without a channel. Scale is dropped.
+	fquat LocalRotation;
+	vec3 LocalTranslation;
+
+	Joint()
+	{
+		Parent = INVALID_JOINT;
+		BoneIndex = INVALID_JOINT;
+		Channel = INVALID_CHANNEL;
+		Motion = JOINT_STATIC;
+		Dynamic = false;
+		SetLocalTransformation(mat4(1.0f));
+	}
+
+	void SetLocalTransformation(const mat4& Local)
+	{
+		LocalTransformation = Local;
+		mat3 Rotation(normalize(vec3(Local[0])), normalize(vec3(Local[1])), normalize(vec3(Local[2])));
+		LocalRotation = normalize(quat_cast(Rotation));
+		LocalTranslation = vec3(Local[3]);
+	}
+};
+
+// One skeletal level of detail. Culled joints are neither sampled nor
+// evaluated, and the weights of culled bones belong to their nearest
+// retained ancestor bone: BoneRemap maps every bone index to the bone that
+// skins its vertices at this level.
+struct SkeletonLOD
+{
+	// Joints whose subtree deforms less than this, in model units, are culled.
+	float MinExtent;
+	vector<bool> Retained;
+	vector<unsigned int> AnimatedJoints;
+	vector<unsigned int> DynamicJoints;
+	// Dynamic joints that are bones, i.e. the palette entries that change.
+	vector<unsigned int> DynamicBones;
+	vector<unsigned int> BoneRemap;
+	unsigned int NumRetained;
+};
+
+// Load-time compiled copy of the aiNode tree. Only nodes that are bones or
+// ancestors of bones are kept; everything is resolved to indices so the
+// per-frame update needs no strings, maps or recursion.
+class Skeleton
+{
+public:
+	vector<Joint> Joints;
+
+	void Build(const aiNode* pRoot, const map<string, unsigned int>& boneMapping, const AnimationClip* pClip)
+	{
+		Joints.clear();
+		addJoint(pRoot, INVALID_JOINT, boneMapping, pClip);
+	}
+
+	unsigned int NumJoints() const
+	{
+		return (unsigned int)Joints.size();
+	}
+
+	// Extents[i] is how far from joint i the vertices of its subtree reach
+	// in the bind pose, so it never grows from parent to child and culling a
+	// joint culls its subtree. The first bone on every path is kept so each
+	// culled bone has an ancestor to take its weights.
+	void BuildLOD(const vector<float>& Extents, float MinExtent, unsigned int NumBones, SkeletonLOD& LOD) const
+	{
+		unsigned int Count = NumJoints();
+		vector<int> NearestBone(Count, INVALID_JOINT);
+
+		LOD.MinExtent = MinExtent;
+		LOD.Retained.assign(Count, false);
+		LOD.AnimatedJoints.clear();
+		LOD.DynamicJoints.clear();
+		LOD.DynamicBones.clear();
+		LOD.BoneRemap.resize(NumBones);
+		for(unsigned int i = 0; i < NumBones; i++)
+			LOD.BoneRemap[i] = i;
+		LOD.NumRetained = 0;
+
+		for(unsigned int i = 0; i < Count; i++)
+		{
+			const Joint& joint = Joints[i];
+			bool ParentRetained = joint.Parent == INVALID_JOINT || LOD.Retained[joint.Parent];
+			int Ancestor = joint.Parent == INVALID_JOINT ? INVALID_JOINT : NearestBone[joint.Parent];
+
+			bool Retained = ParentRetained && (Extents[i] >= MinExtent || Ancestor == INVALID_JOINT);
+			LOD.Retained[i] = Retained;
+			NearestBone[i] = Retained && joint.BoneIndex != INVALID_JOINT ? (int)i : Ancestor;
+
+			if(joint.BoneIndex != INVALID_JOINT && NearestBone[i] != INVALID_JOINT)
+				LOD.BoneRemap[joint.BoneIndex] = Joints[NearestBone[i]].BoneIndex;
+			if(!Retained)
+				continue;
+
+			LOD.NumRetained++;
+			if(joint.Motion != JOINT_STATIC)
+				LOD.AnimatedJoints.push_back(i);
+			if(joint.Dynamic)
+				LOD.DynamicJoints.push_back(i);
+			if(joint.Dynamic && joint.BoneIndex != INVALID_JOINT)
+				LOD.DynamicBones.push_back(i);
+		}
+	}
+
+private:
+	void addJoint(const aiNode* pNode, int parent, const map<string, unsigned int>& boneMapping, const AnimationClip* pClip)
+	{
+		if(!hasBones(pNode, boneMapping))
+			return;
+
+		string NodeName(pNode->mName.data);
+		int JointIndex = (int)Joints.size();
+
+		Joint joint;
+		joint.Name = NodeName;
+		joint.Parent = parent;
+
+		aiMatrix4x4 tp1 = pNode->mTransformation;
+		joint.SetLocalTransformation(transpose(make_mat4(&tp1.a1)));
+
+		map<string, unsigned int>::const_iterator bone = boneMapping.find(NodeName);
+		if(bone != boneMapping.end())
+			joint.BoneIndex = (int)bone->second;
+
+		// Nodes above the bones (an armature root, a controller) can be
+		// animated too.
+		if(pClip)
+			joint.Channel = pClip->FindChannel(NodeName);
+
+		if(joint.Channel != INVALID_CHANNEL)
+		{
+			const ClipChannel& channel = pClip->Channels[joint.Channel];
+			if(!pClip->ConstantRotation(channel))
+				joint.Motion = pClip->ConstantPosition(channel) ? JOINT_ROTATION_ONLY : JOINT_ANIMATED;
+			else if(!pClip->ConstantPosition(channel))
+				joint.Motion = JOINT_ANIMATED;
+		}
+		joint.Dynamic = joint.Motion != JOINT_STATIC || (parent != INVALID_JOINT && Joints[parent].Dynamic);
+		Joints.push_back(joint);
+
+		for(unsigned int i = 0; i < pNode->mNumChildren; i++)
+			addJoint(pNode->mChildren[i], JointIndex, boneMapping, pClip);
+	}
+
+	bool hasBones(const aiNode* pNode, const map<string, unsigned int>& boneMapping) const
+	{
+		if(boneMapping.find(pNode->mName.data) != boneMapping.end())
+			return true;
+
+		for(unsigned int i = 0; i < pNode->mNumChildren; i++)
+			if(hasBones(pNode->mChildren[i], boneMapping))
+				return true;
+
+		return false;
+	}
+};
+#endif
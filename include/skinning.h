@@ -0,0 +1,150 @@
+#ifndef SKINNING_H
+#define SKINNING_H
+
+#include <glm/glm.hpp>
+#include <glm\gtx\dual_quaternion.hpp>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace glm;
+
+// Which bone palette the vertex shader consumes. The evaluator only builds
+// the transforms the selected mode needs.
+enum SkinningMode
+{
+	// mat4 per bone
+	SKINNING_LBS,
+	// the top three rows of the bone matrix as a mat3x4
+	SKINNING_AFFINE,
+	// dual quaternion as a mat2x4
+	SKINNING_DQ
+};
+
+// The one vertex shader source every skinning variant is built from.
+#define SKINNING_VERTEX_SHADER "./shaders/skinning.vs"
+
+// One variant of shaders/skinning.vs. Defines() is both what Shader
+// injects into the source and the variant's key in a ShaderCache.
+struct SkinningPermutation
+{
+	SkinningMode Mode;
+	unsigned int NumInfluences;
+	// Bones come from a BakedPalettes texture instead of a uniform array.
+	bool Baked;
+	// Length of the uniform bone array; unused when Baked.
+	unsigned int MaxBones;
+	// DQ only: transform by the dual quaternion instead of its matrix.
+	bool OptimisedDQ;
+
+	SkinningPermutation(SkinningMode mode = SKINNING_DQ, unsigned int numInfluences = 4, bool baked = false, unsigned int maxBones = 100, bool optimisedDQ = false)
+	{
+		Mode = mode;
+		NumInfluences = numInfluences;
+		Baked = baked;
+		MaxBones = maxBones;
+		OptimisedDQ = optimisedDQ;
+	}
+
+	// Options a variant ignores are left out, so equivalent permutations
+	// share a program. Bakes of matrices are always affine.
+	string Defines() const
+	{
+		SkinningMode mode = Baked && Mode == SKINNING_LBS ? SKINNING_AFFINE : Mode;
+		string defines = "#define SKINNING_MODE " + to_string((int)mode) + "\n";
+		defines += "#define NUM_INFLUENCES " + to_string(NumInfluences) + "\n";
+		if(Baked)
+			defines += "#define BAKED_PALETTES 1\n";
+		else
+			defines += "#define MAX_BONES " + to_string(max(MaxBones, 1u)) + "\n";
+		if(mode == SKINNING_DQ && OptimisedDQ)
+			defines += "#define DQ_OPTIMISED 1\n";
+		return defines;
+	}
+};
+
+// Output of SkinnedModelAsset::Evaluate. Only the array for Mode is filled.
+struct BonePalette
+{
+	SkinningMode Mode;
+	vector<mat4> Matrices;
+	vector<mat3x4> Affine;
+	vector<mat2x4> DualQuaternions;
+
+	BonePalette()
+	{
+		Mode = SKINNING_DQ;
+	}
+
+	unsigned int Size() const
+	{
+		if(Mode == SKINNING_LBS)
+			return (unsigned int)Matrices.size();
+		if(Mode == SKINNING_AFFINE)
+			return (unsigned int)Affine.size();
+		return (unsigned int)DualQuaternions.size();
+	}
+
+	// The array for Mode as floats, for kernels that write it directly.
+	float* Data()
+	{
+		if(Mode == SKINNING_LBS)
+			return &Matrices[0][0][0];
+		if(Mode == SKINNING_AFFINE)
+			return &Affine[0][0][0];
+		return &DualQuaternions[0][0][0];
+	}
+
+	const float* Data() const
+	{
+		return const_cast<BonePalette*>(this)->Data();
+	}
+};
+
+// Palettes of a whole batch in one allocation: instance i owns the
+// BonesPerInstance entries starting at Offset(i) of the array for Mode.
+struct PaletteBuffer
+{
+	SkinningMode Mode;
+	unsigned int BonesPerInstance;
+	unsigned int NumInstances;
+	vector<mat4> Matrices;
+	vector<mat3x4> Affine;
+	vector<mat2x4> DualQuaternions;
+
+	PaletteBuffer()
+	{
+		Mode = SKINNING_DQ;
+		BonesPerInstance = 0;
+		NumInstances = 0;
+	}
+
+	void Resize(SkinningMode mode, unsigned int numInstances, unsigned int bonesPerInstance)
+	{
+		Mode = mode;
+		NumInstances = numInstances;
+		BonesPerInstance = bonesPerInstance;
+		unsigned int Size = numInstances * bonesPerInstance;
+		Matrices.resize(Mode == SKINNING_LBS ? Size : 0);
+		Affine.resize(Mode == SKINNING_AFFINE ? Size : 0);
+		DualQuaternions.resize(Mode == SKINNING_DQ ? Size : 0);
+	}
+
+	unsigned int Offset(unsigned int Instance) const
+	{
+		return Instance * BonesPerInstance;
+	}
+
+	// Copies instance From's palette over instance To's.
+	void Copy(unsigned int From, unsigned int To)
+	{
+		if(Mode == SKINNING_LBS)
+			copy(Matrices.begin() + Offset(From), Matrices.begin() + Offset(From) + BonesPerInstance, Matrices.begin() + Offset(To));
+		else if(Mode == SKINNING_AFFINE)
+			copy(Affine.begin() + Offset(From), Affine.begin() + Offset(From) + BonesPerInstance, Affine.begin() + Offset(To));
+		else
+			copy(DualQuaternions.begin() + Offset(From), DualQuaternions.begin() + Offset(From) + BonesPerInstance, DualQuaternions.begin() + Offset(To));
+	}
+};
+#endif
@@ -0,0 +1,64 @@
+#ifndef UPDATE_RATE_LOD_H
+#define UPDATE_RATE_LOD_H
+
+#include <glm/glm.hpp>
+
+#include "camera.h"
+#include "animation_instance.h"
+
+#include <cmath>
+using namespace glm;
+
+// Picks how often an instance is re-evaluated, and its skeletal LOD, from
+// how large it is on screen. Instances nearer than Distances[0] update every
+// frame at full detail, then every 2, 4 and 8 frames at the next coarser
+// skeletal LOD past each further threshold. Distances are for the
+// default field of view; zooming in scales them so a magnified character
+// keeps updating at full rate.
+struct UpdateRateLOD
+{
+	float Distances[3];
+
+	UpdateRateLOD()
+	{
+		Distances[0] = 3.0f;
+		Distances[1] = 6.0f;
+		Distances[2] = 12.0f;
+	}
+
+	// Distance band 0 to 3; the update interval is 1 << Level and the
+	// skeletal LOD is Level.
+	unsigned int Level(const Camera& camera, const vec3& Position) const
+	{
+		float Distance = length(Position - camera.Position);
+		Distance *= tan(radians(camera.Zoom) * 0.5f) / tan(radians(ZOOM) * 0.5f);
+
+		unsigned int Level = 0;
+		while(Level < 3 && Distance >= Distances[Level])
+			Level++;
+		return Level;
+	}
+
+	unsigned int Interval(const Camera& camera, const vec3& Position) const
+	{
+		return 1 << Level(camera, Position);
+	}
+
+	// Sets Instance.UpdateInterval and returns whether it is evaluated on
+	// this frame. Instances without a palette for their current clip and
+	// mode, sampled or copied from a PoseCache, always are. On skipped
+	// frames the previous palette is reused, so the skeletal LOD only
+	// changes on frames that evaluate.
+	bool Update(AnimationInstance& Instance, const Camera& camera, const vec3& Position, unsigned int Frame) const
+	{
+		unsigned int level = Level(camera, Position);
+		Instance.UpdateInterval = 1 << level;
+
+		bool Evaluate = Instance.PosedClip != (int)Instance.Clip || Instance.PosedMode != Instance.Mode
+			|| (Frame + Instance.UpdatePhase) % Instance.UpdateInterval == 0;
+		if(Evaluate)
+			Instance.LOD = level;
+		return Evaluate;
+	}
+};
+#endif
@@ -0,0 +1,60 @@
+#ifndef VERTEX_LAYOUT_H
+#define VERTEX_LAYOUT_H
+
+#include <glad/glad.h>
+
+#include <cstddef>
+
+// Attribute locations and the vertex shader inputs they feed; Shader binds
+// these names and every vertex layout uses these locations.
+#define VERTEX_ATTRIBUTE_NAMES(X) \
+	X(0, "aPos") \
+	X(1, "aNormal") \
+	X(2, "aTexCoords") \
+	X(3, "BoneIDs") \
+	X(4, "Weights") \
+	X(5, "BoneIDs1") \
+	X(6, "Weights1")
+
+// Vertex layouts as X(Struct, Location, Member, Count, Type, Normalized,
+// Integer). The attribute pointers and the size and stride checks below
+// are generated from these lists, so a member and its attribute cannot
+// drift apart. Integer attributes go through glVertexAttribIPointer.
+#define FLOAT_VERTEX_LAYOUT(X) \
+	X(Vertex, 0, Position, 3, GL_FLOAT, GL_FALSE, false) \
+	X(Vertex, 1, Normal, 3, GL_FLOAT, GL_FALSE, false) \
+	X(Vertex, 2, TexCoords, 2, GL_FLOAT, GL_FALSE, false)
+
+#define PACKED_VERTEX_LAYOUT(X) \
+	X(PackedVertex, 0, Position, 3, GL_UNSIGNED_SHORT, GL_TRUE, false) \
+	X(PackedVertex, 1, Normal, 2, GL_BYTE, GL_TRUE, false) \
+	X(PackedVertex, 2, TexCoords, 2, GL_HALF_FLOAT, GL_FALSE, false) \
+	X(PackedVertex, 3, BoneIDs, 4, GL_UNSIGNED_BYTE, GL_FALSE, true) \
+	X(PackedVertex, 4, Weights, 4, GL_UNSIGNED_SHORT, GL_TRUE, false)
+
+constexpr unsigned int GLTypeSize(GLenum Type)
+{
+	return Type == GL_FLOAT || Type == GL_INT || Type == GL_UNSIGNED_INT ? 4
+		: Type == GL_SHORT || Type == GL_UNSIGNED_SHORT || Type == GL_HALF_FLOAT ? 2 : 1;
+}
+
+#define VERTEX_ATTRIBUTE_BYTES(Struct, Location, Member, Count, Type, Normalized, Integer) + Count * GLTypeSize(Type)
+
+#define VERTEX_ATTRIBUTE_CHECK(Struct, Location, Member, Count, Type, Normalized, Integer) \
+	static_assert(sizeof(((Struct*)0)->Member) == Count * GLTypeSize(Type), #Struct "::" #Member " does not match its attribute");
+
+// The struct has exactly the listed members, with no padding between them.
+#define VERTEX_LAYOUT_CHECK(Struct, Layout) \
+	Layout(VERTEX_ATTRIBUTE_CHECK) \
+	static_assert(sizeof(Struct) == 0 Layout(VERTEX_ATTRIBUTE_BYTES), #Struct " has bytes outside its layout");
+
+#define VERTEX_ATTRIBUTE_POINTER(Struct, Location, Member, Count, Type, Normalized, Integer) \
+	glEnableVertexAttribArray(Location); \
+	if(Integer) \
+		glVertexAttribIPointer(Location, Count, Type, sizeof(Struct), (const GLvoid*)offsetof(Struct, Member)); \
+	else \
+		glVertexAttribPointer(Location, Count, Type, Normalized, sizeof(Struct), (const GLvoid*)offsetof(Struct, Member));
+
+// Points the attributes of Layout at the buffer bound to GL_ARRAY_BUFFER.
+#define SETUP_VERTEX_LAYOUT(Layout) Layout(VERTEX_ATTRIBUTE_POINTER)
+#endif
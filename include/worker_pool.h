@@ -0,0 +1,141 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// Fixed set of threads that split index ranges between themselves and the
+// calling thread. Chunks are handed out through one atomic counter, so
+// uneven work (different clips, different bone counts) still balances.
+class WorkerPool
+{
+public:
+	// NumThreads counts the calling thread; 0 uses every hardware thread.
+	WorkerPool(unsigned int NumThreads = 0)
+	{
+		if(NumThreads == 0)
+			NumThreads = thread::hardware_concurrency();
+		if(NumThreads == 0)
+			NumThreads = 1;
+
+		m_Job = nullptr;
+		m_Count = 0;
+		m_Grain = 1;
+		m_Next = 0;
+		m_Busy = 0;
+		m_Generation = 0;
+		m_Quit = false;
+
+		for(unsigned int i = 1; i < NumThreads; i++)
+			m_Threads.push_back(thread(&WorkerPool::workerLoop, this));
+	}
+
+	~WorkerPool()
+	{
+		{
+			lock_guard<mutex> lock(m_Mutex);
+			m_Quit = true;
+		}
+		m_Wake.notify_all();
+		for(unsigned int i = 0; i < m_Threads.size(); i++)
+			m_Threads[i].join();
+	}
+
+	unsigned int NumThreads() const
+	{
+		return (unsigned int)m_Threads.size() + 1;
+	}
+
+	// Calls Job(Begin, End) for consecutive chunks of at most Grain indices
+	// covering [0, Count), and returns once every chunk has run. Calls from
+	// several threads take turns; a Job must not call back into the pool.
+	void ParallelFor(unsigned int Count, unsigned int Grain, const function<void(unsigned int, unsigned int)>& Job)
+	{
+		if(Grain == 0)
+			Grain = 1;
+		if(m_Threads.empty() || Count <= Grain)
+		{
+			if(Count > 0)
+				Job(0, Count);
+			return;
+		}
+
+		lock_guard<mutex> call(m_CallMutex);
+		{
+			unique_lock<mutex> lock(m_Mutex);
+			m_Done.wait(lock, [this] { return m_Busy == 0; });
+			m_Job = &Job;
+			m_Count = Count;
+			m_Grain = Grain;
+			m_Next = 0;
+			m_Generation++;
+		}
+		m_Wake.notify_all();
+
+		runChunks();
+
+		unique_lock<mutex> lock(m_Mutex);
+		m_Done.wait(lock, [this] { return m_Busy == 0; });
+		m_Job = nullptr;
+	}
+
+private:
+	vector<thread> m_Threads;
+	// Held for a whole ParallelFor, so one caller's job and chunk counter
+	// are never replaced while it is still running chunks.
+	mutex m_CallMutex;
+	mutex m_Mutex;
+	condition_variable m_Wake;
+	condition_variable m_Done;
+
+	// The current job. Only written while no worker is busy.
+	const function<void(unsigned int, unsigned int)>* m_Job;
+	unsigned int m_Count;
+	unsigned int m_Grain;
+	atomic<unsigned int> m_Next;
+
+	unsigned int m_Busy;
+	unsigned int m_Generation;
+	bool m_Quit;
+
+	void runChunks()
+	{
+		for(;;)
+		{
+			unsigned int Begin = m_Next.fetch_add(m_Grain);
+			if(Begin >= m_Count)
+				return;
+
+			unsigned int End = Begin + m_Grain < m_Count ? Begin + m_Grain : m_Count;
+			(*m_Job)(Begin, End);
+		}
+	}
+
+	void workerLoop()
+	{
+		unsigned int Seen = 0;
+		unique_lock<mutex> lock(m_Mutex);
+		for(;;)
+		{
+			m_Wake.wait(lock, [this, &Seen] { return m_Quit || m_Generation != Seen; });
+			if(m_Quit)
+				return;
+
+			Seen = m_Generation;
+			m_Busy++;
+			lock.unlock();
+
+			runChunks();
+
+			lock.lock();
+			if(--m_Busy == 0)
+				m_Done.notify_all();
+		}
+	}
+};
+#endif
@@ -0,0 +1,197 @@
+#version 150 core
+// Every skinning shader is a variant of this source. Shader puts the
+// defines of a SkinningPermutation (see skinning.h) after #version:
+//   SKINNING_MODE   0 mat4 (LBS), 1 mat3x4 (affine), 2 dual quaternion
+//   NUM_INFLUENCES  influences blended per vertex: 2, 4 or 8
+//   BAKED_PALETTES  bones come from a BakedPalettes texture, not a uniform array
+//   MAX_BONES       length of the uniform bone array
+//   DQ_OPTIMISED    transform by the blended dual quaternion directly
+//                   instead of building its matrix
+#ifndef SKINNING_MODE
+#define SKINNING_MODE 2
+#endif
+#ifndef NUM_INFLUENCES
+#define NUM_INFLUENCES 4
+#endif
+#ifndef BAKED_PALETTES
+#define BAKED_PALETTES 0
+#endif
+#ifndef MAX_BONES
+#define MAX_BONES 100
+#endif
+#ifndef DQ_OPTIMISED
+#define DQ_OPTIMISED 0
+#endif
+
+in vec3 aPos;
+in vec3 aNormal;
+in vec2 aTexCoords;
+// Packed skin attributes (see PackedSkinAttributes in mesh.h): unsigned
+// byte or short bone indices, and unorm16 weights that sum to 1. Past
+// four influences, the rest come in BoneIDs1 and Weights1.
+in uvec4 BoneIDs;
+in vec4 Weights;
+#if NUM_INFLUENCES > 4
+in uvec4 BoneIDs1;
+in vec4 Weights1;
+#endif
+
+
+out vec2 TexCoords;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+// Bounds of the quantized vertex layout's positions; (0, 0, 0) and
+// (1, 1, 1) for float vertices.
+uniform vec3 gPositionMin;
+uniform vec3 gPositionExtent;
+
+#if BAKED_PALETTES
+// Baked palettes (BakedPalettes): dual quaternions two texels per bone,
+// 3x4 matrices one texel per row.
+uniform samplerBuffer gBakedPalettes;
+uniform int gBonesPerFrame;
+// The character's clip inside the bake and its time in seconds, wrapped.
+// A zero-length clip plays its first frame.
+uniform int gFirstFrame;
+uniform int gNumFrames;
+uniform float gClipLength;
+uniform float gClipTime;
+#elif SKINNING_MODE == 0
+uniform mat4 gBones[MAX_BONES];
+#elif SKINNING_MODE == 1
+// Rows of each bone matrix; the fourth row is always (0, 0, 0, 1).
+uniform mat3x4 gBones[MAX_BONES];
+#else
+uniform mat2x4 dqs[MAX_BONES];
+#endif
+
+int BoneID(int i) {
+#if NUM_INFLUENCES > 4
+	if (i >= 4) return int(BoneIDs1[i - 4]);
+#endif
+	return int(BoneIDs[i]);
+}
+
+float Weight(int i) {
+#if NUM_INFLUENCES > 4
+	if (i >= 4) return Weights1[i - 4];
+#endif
+	return Weights[i];
+}
+
+#if SKINNING_MODE == 2
+mat4x4 DQtoMat(vec4 real, vec4 dual) {
+	mat4x4 m;
+	float len2 = dot(real, real);
+	float w = real.w, x = real.x, y = real.y, z = real.z;
+	float t0 = dual.w, t1 = dual.x, t2 = dual.y, t3 = dual.z;
+
+	m[0][0] = w * w + x * x - y * y - z * z;
+	m[1][0] = 2 * x * y - 2 * w * z;
+	m[2][0] = 2 * x * z + 2 * w * y;
+	m[0][1] = 2 * x * y + 2 * w * z;
+	m[1][1] = w * w + y * y - x * x - z * z;
+	m[2][1] = 2 * y * z - 2 * w * x;
+	m[0][2] = 2 * x * z - 2 * w * y;
+	m[1][2] = 2 * y * z + 2 * w * x;
+	m[2][2] = w * w + z * z - x * x - y * y;
+
+	m[3][0] = -2 * t0 * x + 2 * w * t1 - 2 * t2 * z + 2 * y * t3;
+	m[3][1] = -2 * t0 * y + 2 * t1 * z - 2 * x * t3 + 2 * w * t2;
+	m[3][2] = -2 * t0 * z + 2 * x * t2 + 2 * w * t3 - 2 * t1 * y;
+
+	m[0][3] = 0;
+	m[1][3] = 0;
+	m[2][3] = 0;
+	m[3][3] = len2;
+	m /= len2;
+
+	return m;
+}
+#endif
+
+#if BAKED_PALETTES
+// The two frames around gClipTime and how far between them it is.
+int frame0;
+int frame1;
+float factor;
+
+#if SKINNING_MODE == 2
+mat2x4 Bone(int bone) {
+	int texel0 = ((frame0 * gBonesPerFrame) + bone) * 2;
+	int texel1 = ((frame1 * gBonesPerFrame) + bone) * 2;
+	mat2x4 dq0 = mat2x4(texelFetch(gBakedPalettes, texel0), texelFetch(gBakedPalettes, texel0 + 1));
+	mat2x4 dq1 = mat2x4(texelFetch(gBakedPalettes, texel1), texelFetch(gBakedPalettes, texel1 + 1));
+
+	if (dot(dq0[0], dq1[0]) < 0.0) dq1 *= -1.0;
+	return dq0 * (1.0 - factor) + dq1 * factor;
+}
+#else
+mat3x4 Bone(int bone) {
+	int texel0 = ((frame0 * gBonesPerFrame) + bone) * 3;
+	int texel1 = ((frame1 * gBonesPerFrame) + bone) * 3;
+	mat3x4 bone0 = mat3x4(texelFetch(gBakedPalettes, texel0), texelFetch(gBakedPalettes, texel0 + 1), texelFetch(gBakedPalettes, texel0 + 2));
+	mat3x4 bone1 = mat3x4(texelFetch(gBakedPalettes, texel1), texelFetch(gBakedPalettes, texel1 + 1), texelFetch(gBakedPalettes, texel1 + 2));
+	return bone0 * (1.0 - factor) + bone1 * factor;
+}
+#endif
+#elif SKINNING_MODE == 0
+mat4 Bone(int bone) { return gBones[bone]; }
+#elif SKINNING_MODE == 1
+mat3x4 Bone(int bone) { return gBones[bone]; }
+#else
+mat2x4 Bone(int bone) { return dqs[bone]; }
+#endif
+
+void main() {
+
+	TexCoords = aTexCoords;
+	vec3 restPos = gPositionMin + aPos * gPositionExtent;
+
+#if BAKED_PALETTES
+	float frame = gClipLength > 0.0 ? fract(gClipTime / gClipLength) * float(gNumFrames) : 0.0;
+	int index = min(int(frame), gNumFrames - 1);
+	frame0 = gFirstFrame + index;
+	frame1 = gFirstFrame + (index + 1) % gNumFrames;
+	factor = frame - float(index);
+#endif
+
+#if SKINNING_MODE == 2
+	mat2x4 dq0 = Bone(BoneID(0));
+	mat2x4 blendDQ = dq0 * Weight(0);
+	for (int i = 1; i < NUM_INFLUENCES; i++) {
+		mat2x4 dq = Bone(BoneID(i));
+		if (dot(dq0[0], dq[0]) < 0.0) dq *= -1.0;
+		blendDQ += dq * Weight(i);
+	}
+
+#if DQ_OPTIMISED
+	float len = length(blendDQ[0]);
+	blendDQ /= len;
+
+	vec3 position = restPos + 2.0*cross(blendDQ[0].xyz, cross(blendDQ[0].xyz, restPos) + blendDQ[0].w * restPos);
+	vec3 trans = 2.0*(blendDQ[0].w * blendDQ[1].xyz - blendDQ[1].w * blendDQ[0].xyz + cross(blendDQ[0].xyz, blendDQ[1].xyz));
+	vec4 pos = vec4(position + trans, 1.0);
+#else
+	mat4x4 DQmat = DQtoMat(blendDQ[0], blendDQ[1]);
+	vec4 pos = DQmat * vec4(restPos, 1.0);
+#endif
+#elif SKINNING_MODE == 1
+	mat3x4 BoneTransform = Bone(BoneID(0)) * Weight(0);
+	for (int i = 1; i < NUM_INFLUENCES; i++)
+		BoneTransform += Bone(BoneID(i)) * Weight(i);
+
+	vec4 pos = vec4(vec4(restPos, 1.0) * BoneTransform, 1.0);
+#else
+	mat4 BoneTransform = Bone(BoneID(0)) * Weight(0);
+	for (int i = 1; i < NUM_INFLUENCES; i++)
+		BoneTransform += Bone(BoneID(i)) * Weight(i);
+
+	vec4 pos = BoneTransform * vec4(restPos, 1.0);
+#endif
+
+	gl_Position = projection * view * model * pos;
+
+}
@@ -15,7 +15,12 @@
 #include "../include/stb_image.h"
 #include "../include/mesh.h"
 #include "../include/model.h"
+#include "../include/job_system.h"
+#include "../include/update_rate_lod.h"
+#include "../include/pose_cache.h"
+#include "../include/baked_palettes.h"
 
+#include <chrono>
 #include <iostream>
 
 using namespace glm;
@@ -29,15 +34,49 @@ float lastX = W / 2;
 float lastY = H / 2;
 bool firstMouse = 1;
 
-vector<mat4> Transforms;
-vector<mat2x4> DQs;
-vector<fdualquat> dualQuaternions;
+// Characters are drawn on a CROWD_SIZE x CROWD_SIZE grid, CROWD_SPACING apart.
+const int CROWD_SIZE = 8;
+const float CROWD_SPACING = 1.5f;
+// Characters per job; each batch is sampled, posed and drawn as one chain.
+const unsigned int CROWD_BATCH = 8;
+
+vector<AnimationInstance> crowd(CROWD_SIZE * CROWD_SIZE);
+// Whether crowd[i] is evaluated this frame; the others keep their palette.
+vector<char> updating(CROWD_SIZE * CROWD_SIZE);
+// The instance whose palette crowd[i] uses this frame (i itself on a pose
+// cache miss), and the time the owner samples at.
+vector<unsigned int> poseOwner(CROWD_SIZE * CROWD_SIZE);
+vector<float> sampleTime(CROWD_SIZE * CROWD_SIZE);
+PoseCache poses;
+// Characters at this distance band or further play baked palettes on the
+// GPU and cost no CPU evaluation.
+const unsigned int BAKED_LEVEL = 2;
+const float BAKE_RATE = 60.0f;
+const char* BAKE_CACHE = "./resources/man/model.dae.bake";
+vector<char> baked(CROWD_SIZE * CROWD_SIZE);
+PaletteBuffer palettes;
+UpdateRateLOD lod;
+unsigned int frameIndex = 0;
 float dt = 0;
 float lastFrame = 0;
 float animationTime = 0;
+float lastStats = 0;
 
 vec3 lightPos(1.2f, 1.0f, 2.0f);
 
+mat4 crowdModel(unsigned int i)
+{
+	float x = (i % CROWD_SIZE - (CROWD_SIZE - 1) * 0.5f) * CROWD_SPACING;
+	float z = -(float)(i / CROWD_SIZE) * CROWD_SPACING;
+
+	mat4 model = mat4(1.0f);
+	model = scale(model, vec3(.5, .5, .5));
+	model = translate(model, vec3(x, 0, z));
+	const quat& rot = angleAxis(radians(-90.f), vec3(1.f, 0.f, 0.f));/*rotation*/
+	model *= mat4_cast(rot);
+	return model;
+}
+
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     glViewport(0, 0, width, height);
@@ -83,8 +122,301 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 	camera.ProcessMouseScroll(yoffset);
 }
 
-int main()
+ClipCompressionSettings demoCompression()
+{
+	ClipCompressionSettings compression;
+	compression.ReduceKeys = true;
+	compression.Quantize = true;
+	compression.ErrorBudgetMM = 0.5f;
+	return compression;
+}
+
+// --verify-bake: loads the model without a window, bakes it (or reads the
+// cache) and compares the baked poses with Evaluate.
+int verifyBake()
+{
+	SkinnedModelAsset mdl("./resources/man/model.dae", false, demoCompression(), true);
+	for(unsigned int mode = SKINNING_AFFINE; mode <= SKINNING_DQ; mode++)
+	{
+		BakedPalettes bake;
+		bake.Bake(mdl, (SkinningMode)mode, BAKE_RATE);
+		float onFrames = bake.Verify(mdl, 256, true);
+		float betweenFrames = bake.Verify(mdl, 256, false);
+		cout << "BAKE::" << (mode == SKINNING_DQ ? "dq" : "affine") << ": " << bake.Texels.size() * sizeof(vec4) << " bytes, max error "
+			<< onFrames << " on frames, " << betweenFrames << " between frames" << endl;
+		if(onFrames > 1e-4f)
+			return 1;
+	}
+	return 0;
+}
+
+// Generated skeleton for --bench: a binary tree of NumBones joints, all
+// animated on one shared timeline, each skinning a triangle at its joint.
+aiScene* syntheticScene(unsigned int NumBones)
+{
+	const unsigned int NumKeys = 30;
+
+	aiScene* pScene = new aiScene();
+	aiNode* pRoot = new aiNode();
+	pRoot->mName = aiString("Scene");
+
+	vector<aiNode*> nodes(NumBones);
+	vector<aiVector3D> offsets(NumBones), positions(NumBones);
+	for(unsigned int i = 0; i < NumBones; i++)
+	{
+		nodes[i] = new aiNode();
+		nodes[i]->mName = aiString(("Bone" + to_string(i)).c_str());
+		offsets[i] = aiVector3D(0.05f * (float)(i % 3) - 0.05f, 0.1f, 0.05f * (float)(i / 3 % 3) - 0.05f);
+		nodes[i]->mTransformation.a4 = offsets[i].x;
+		nodes[i]->mTransformation.b4 = offsets[i].y;
+		nodes[i]->mTransformation.c4 = offsets[i].z;
+		positions[i] = offsets[i];
+		if(i > 0)
+			positions[i] += positions[(i - 1) / 2];
+	}
+
+	// Children arrays: the root holds bone 0 and the mesh node.
+	pRoot->mNumChildren = NumBones > 0 ? 2 : 1;
+	pRoot->mChildren = new aiNode*[pRoot->mNumChildren];
+	aiNode* pMeshNode = new aiNode();
+	pMeshNode->mName = aiString("Mesh");
+	pMeshNode->mParent = pRoot;
+	pMeshNode->mNumMeshes = 1;
+	pMeshNode->mMeshes = new unsigned int[1];
+	pMeshNode->mMeshes[0] = 0;
+	pRoot->mChildren[pRoot->mNumChildren - 1] = pMeshNode;
+	if(NumBones > 0)
+	{
+		pRoot->mChildren[0] = nodes[0];
+		nodes[0]->mParent = pRoot;
+	}
+	for(unsigned int i = 0; i < NumBones; i++)
+	{
+		unsigned int First = 2 * i + 1;
+		unsigned int Count = First >= NumBones ? 0 : (First + 1 < NumBones ? 2 : 1);
+		nodes[i]->mNumChildren = Count;
+		nodes[i]->mChildren = Count > 0 ? new aiNode*[Count] : nullptr;
+		for(unsigned int c = 0; c < Count; c++)
+		{
+			nodes[i]->mChildren[c] = nodes[First + c];
+			nodes[First + c]->mParent = nodes[i];
+		}
+	}
+	pScene->mRootNode = pRoot;
+
+	aiMesh* pMesh = new aiMesh();
+	pMesh->mNumVertices = 3 * NumBones;
+	pMesh->mVertices = new aiVector3D[pMesh->mNumVertices];
+	pMesh->mNormals = new aiVector3D[pMesh->mNumVertices];
+	pMesh->mNumFaces = NumBones;
+	pMesh->mFaces = new aiFace[NumBones];
+	pMesh->mNumBones = NumBones;
+	pMesh->mBones = new aiBone*[NumBones];
+	for(unsigned int i = 0; i < NumBones; i++)
+	{
+		aiFace& face = pMesh->mFaces[i];
+		face.mNumIndices = 3;
+		face.mIndices = new unsigned int[3];
+
+		aiBone* pBone = new aiBone();
+		pBone->mName = nodes[i]->mName;
+		pBone->mOffsetMatrix.a4 = -positions[i].x;
+		pBone->mOffsetMatrix.b4 = -positions[i].y;
+		pBone->mOffsetMatrix.c4 = -positions[i].z;
+		pBone->mNumWeights = 3;
+		pBone->mWeights = new aiVertexWeight[3];
+		for(unsigned int v = 0; v < 3; v++)
+		{
+			unsigned int Vertex = 3 * i + v;
+			pMesh->mVertices[Vertex] = positions[i] + aiVector3D(v == 1 ? 0.02f : 0.0f, 0.0f, v == 2 ? 0.02f : 0.0f);
+			pMesh->mNormals[Vertex] = aiVector3D(0.0f, 1.0f, 0.0f);
+			face.mIndices[v] = Vertex;
+			pBone->mWeights[v].mVertexId = Vertex;
+			pBone->mWeights[v].mWeight = 1.0f;
+		}
+		pMesh->mBones[i] = pBone;
+	}
+	pScene->mNumMeshes = 1;
+	pScene->mMeshes = new aiMesh*[1];
+	pScene->mMeshes[0] = pMesh;
+	pScene->mNumMaterials = 1;
+	pScene->mMaterials = new aiMaterial*[1];
+	pScene->mMaterials[0] = new aiMaterial();
+
+	aiAnimation* pAnimation = new aiAnimation();
+	pAnimation->mName = aiString("Synthetic");
+	pAnimation->mTicksPerSecond = 30.0;
+	pAnimation->mDuration = NumKeys - 1;
+	pAnimation->mNumChannels = NumBones;
+	pAnimation->mChannels = new aiNodeAnim*[NumBones];
+	for(unsigned int i = 0; i < NumBones; i++)
+	{
+		aiNodeAnim* pChannel = new aiNodeAnim();
+		pChannel->mNodeName = nodes[i]->mName;
+		pChannel->mNumPositionKeys = NumKeys;
+		pChannel->mPositionKeys = new aiVectorKey[NumKeys];
+		pChannel->mNumRotationKeys = NumKeys;
+		pChannel->mRotationKeys = new aiQuatKey[NumKeys];
+		pChannel->mNumScalingKeys = 1;
+		pChannel->mScalingKeys = new aiVectorKey[1];
+		pChannel->mScalingKeys[0].mTime = 0.0;
+		pChannel->mScalingKeys[0].mValue = aiVector3D(1.0f, 1.0f, 1.0f);
+		for(unsigned int k = 0; k < NumKeys; k++)
+		{
+			float Angle = 0.3f * sin(0.4f * k + 0.7f * i);
+			pChannel->mPositionKeys[k].mTime = k;
+			pChannel->mPositionKeys[k].mValue = offsets[i];
+			pChannel->mRotationKeys[k].mTime = k;
+			pChannel->mRotationKeys[k].mValue = aiQuaternion(cos(Angle * 0.5f), i % 2 == 0 ? sin(Angle * 0.5f) : 0.0f, 0.0f, i % 2 == 0 ? 0.0f : sin(Angle * 0.5f));
+		}
+		pAnimation->mChannels[i] = pChannel;
+	}
+	pScene->mNumAnimations = 1;
+	pScene->mAnimations = new aiAnimation*[1];
+	pScene->mAnimations[0] = pAnimation;
+	return pScene;
+}
+
+// Times EvaluateHierarchy + BuildPalette for every skinning mode, one joint
+// at a time and with the hierarchy kernel on each ISA the CPU runs, and
+// checks the kernel's palettes against the per-joint ones.
+void benchHierarchy(const string& name, SkinnedModelAsset& mdl)
+{
+	const unsigned int NUM_INSTANCES = 64;
+	const unsigned int NUM_FRAMES = 200;
+	const unsigned int COMPONENTS[] = { 16, 12, 8 };
+	if(mdl.Clips.empty())
+	{
+		cout << "BENCH::" << name << ": no clips" << endl;
+		return;
+	}
+
+	vector<AnimationInstance> instances(NUM_INSTANCES);
+	SamplerISA best = DetectSamplerISA();
+	for(unsigned int mode = SKINNING_LBS; mode <= SKINNING_DQ; mode++)
+	{
+		vector<float> reference;
+		// path -1 is the per-joint one, the others the kernel on that ISA.
+		for(int path = -1; path <= (int)best; path++)
+		{
+			mdl.UseHierarchyKernel(path >= 0, path >= 0 ? (SamplerISA)path : best);
+			unsigned int numJoints = 0;
+			for(unsigned int i = 0; i < NUM_INSTANCES; i++)
+			{
+				instances[i].Mode = (SkinningMode)mode;
+				mdl.Sample(instances[i], i * 0.013f);
+				numJoints += mdl.GetLOD(instances[i]).DynamicJoints.size();
+			}
+
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			for(unsigned int f = 0; f < NUM_FRAMES; f++)
+				for(unsigned int i = 0; i < NUM_INSTANCES; i++)
+				{
+					mdl.EvaluateHierarchy(instances[i]);
+					mdl.BuildPalette(instances[i]);
+				}
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+			float maxDiff = 0.0f;
+			for(unsigned int i = 0; i < NUM_INSTANCES; i++)
+			{
+				const float* pPalette = instances[i].Palette.Data();
+				unsigned int size = instances[i].Palette.Size() * COMPONENTS[mode];
+				if(path < 0)
+					reference.insert(reference.end(), pPalette, pPalette + size);
+				else
+					for(unsigned int j = 0; j < size; j++)
+						maxDiff = max(maxDiff, abs(pPalette[j] - reference[i * size + j]));
+			}
+
+			cout << "BENCH::" << name << " " << (mode == SKINNING_LBS ? "lbs" : mode == SKINNING_AFFINE ? "affine" : "dq") << " "
+				<< (path < 0 ? "per joint" : SamplerISAName((SamplerISA)path)) << ": " << seconds * 1e9 / ((double)numJoints * NUM_FRAMES) << " ns/joint";
+			if(path >= 0)
+				cout << ", max diff " << maxDiff;
+			cout << endl;
+		}
+	}
+	mdl.UseHierarchyKernel(true, best);
+}
+
+// Times CPU skinning of every mesh for each skinning mode, with the kernel
+// on each ISA on one thread and on every thread, and checks the output is
+// bit for bit the scalar kernel's.
+void benchSkinning(const string& name, SkinnedModelAsset& mdl)
+{
+	const unsigned int NUM_FRAMES = 200;
+	if(mdl.Clips.empty())
+		return;
+
+	WorkerPool single(1), all;
+	SamplerISA best = DetectSamplerISA();
+	unsigned int numVertices = 0;
+	for(unsigned int m = 0; m < mdl.meshes.size(); m++)
+		numVertices += mdl.meshes[m].vertices.size();
+
+	for(unsigned int mode = SKINNING_LBS; mode <= SKINNING_DQ; mode++)
+	{
+		AnimationInstance instance;
+		instance.Mode = (SkinningMode)mode;
+		instance.Time = 0.37f;
+		mdl.Evaluate(instance);
+
+		vector<SkinnedVertices> reference, skinned;
+		mdl.UseSkinningKernel(SAMPLER_ISA_SCALAR);
+		mdl.Skin(single, instance, reference);
+
+		for(unsigned int isa = SAMPLER_ISA_SCALAR; isa <= (unsigned int)best; isa++)
+			for(unsigned int threads = 0; threads < 2; threads++)
+			{
+				WorkerPool& pool = threads == 0 ? single : all;
+				mdl.UseSkinningKernel((SamplerISA)isa);
+				chrono::steady_clock::time_point start = chrono::steady_clock::now();
+				for(unsigned int f = 0; f < NUM_FRAMES; f++)
+					mdl.Skin(pool, instance, skinned);
+				double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+				bool exact = true;
+				for(unsigned int m = 0; m < skinned.size(); m++)
+					if(!skinned[m].Positions.empty())
+						exact = exact && memcmp(&skinned[m].Positions[0], &reference[m].Positions[0], skinned[m].Positions.size() * sizeof(vec3)) == 0
+							&& memcmp(&skinned[m].Normals[0], &reference[m].Normals[0], skinned[m].Normals.size() * sizeof(vec3)) == 0;
+
+				cout << "BENCH::" << name << " skin " << (mode == SKINNING_LBS ? "lbs" : mode == SKINNING_AFFINE ? "affine" : "dq") << " "
+					<< SamplerISAName((SamplerISA)isa) << " x" << pool.NumThreads() << ": " << seconds * 1e9 / ((double)numVertices * NUM_FRAMES)
+					<< " ns/vertex, " << (exact ? "bit-exact" : "MISMATCH") << endl;
+			}
+	}
+	mdl.UseSkinningKernel(best);
+}
+
+// --bench: hierarchy, palette and CPU skinning cost on the demo model and on
+// a generated 256-bone skeleton, without a window.
+int bench()
+{
+	SkinnedModelAsset man("./resources/man/model.dae", false, ClipCompressionSettings(), true);
+	benchHierarchy("man", man);
+	benchSkinning("man", man);
+
+	aiScene* pScene = syntheticScene(256);
+	{
+		SkinnedModelAsset synthetic(pScene);
+		benchHierarchy("synthetic", synthetic);
+		benchSkinning("synthetic", synthetic);
+	}
+	delete pScene;
+	return 0;
+}
+
+int main(int argc, char** argv)
 {	
+	for(int i = 1; i < argc; i++)
+	{
+		if(string(argv[i]) == "--verify-bake")
+			return verifyBake();
+		if(string(argv[i]) == "--bench")
+			return bench();
+	}
+
 	glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
@@ -108,11 +440,29 @@ int main()
 	
 	glEnable(GL_DEPTH_TEST);
 	
-	Shader shader("./shaders/shader.vs", "./shaders/shader.fs");
+	// Skinning programs are variants of one source, each compiled the first
+	// frame it is drawn with.
+	ShaderCache shaders;
 //	Shader shader("./shaders/1.model_loading.vs", "./shaders/1.model_loading.fs");
 
-	Model mdl("./resources/man/model.dae");
+	SkinnedModelAsset mdl("./resources/man/model.dae", false, demoCompression(), false, true);
+
+	BakedPalettes bake;
+	bake.LoadOrBake(BAKE_CACHE, mdl, SKINNING_DQ, BAKE_RATE);
+	bake.Upload();
+
+	JobSystem jobs;
+	for(unsigned int i = 0; i < crowd.size(); i++)
+	{
+		crowd[i].Time = 0.37f * i;
+		crowd[i].UpdatePhase = i % 8;
+	}
 	
+	// C steps every character to its next clip; handles are fixed at load,
+	// so switching is only an index change.
+	unsigned int clipOffset = 0;
+	bool clipKeyDown = false;
+
 	float startFrame = glfwGetTime();
 	int a = 0;
     while (!glfwWindowShouldClose(window))
@@ -129,46 +479,215 @@ int main()
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         
 //        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-                
-		shader.use();
-        
+
+		if(glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS)
+			palettes.Mode = SKINNING_LBS;
+		if(glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS)
+			palettes.Mode = SKINNING_AFFINE;
+		if(glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS)
+			palettes.Mode = SKINNING_DQ;
+		bool clipKey = glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS;
+		if(clipKey && !clipKeyDown)
+			clipOffset++;
+		clipKeyDown = clipKey;
+
+		unsigned int numUpdating = 0;
+		for(unsigned int i = 0; i < crowd.size(); i++)
+		{
+			mat4 model = crowdModel(i);
+			vec3 position(model[3][0], model[3][1], model[3][2]);
+			crowd[i].Mode = palettes.Mode;
+			if(mdl.NumClips() > 0)
+				crowd[i].Clip = (i + clipOffset) % mdl.NumClips();
+			float clipLength = mdl.NumClips() > 0 ? mdl.Clips[crowd[i].Clip].Length() : 0.0f;
+			crowd[i].Time = clipLength > 0.0f ? fmod(crowd[i].Time + dt, clipLength) : crowd[i].Time + dt;
+
+			// Leaving the bake, the palette slice is stale: evaluate now.
+			bool wasBaked = baked[i] != 0;
+			baked[i] = !bake.Clips.empty() && lod.Level(camera, position) >= BAKED_LEVEL;
+			updating[i] = !baked[i] && lod.Update(crowd[i], camera, position, frameIndex);
+			if(wasBaked && !baked[i] && !updating[i])
+			{
+				crowd[i].LOD = lod.Level(camera, position);
+				updating[i] = 1;
+			}
+			numUpdating += updating[i];
+		}
+		frameIndex++;
+
+		poses.BeginFrame();
+		for(unsigned int i = 0; i < crowd.size(); i++)
+		{
+			if(!updating[i])
+				continue;
+
+			float length = mdl.Clips.empty() ? 0.0f : mdl.Clips[crowd[i].Clip].Length();
+			PoseKey key = poses.MakeKey(crowd[i].Clip, length, crowd[i].Time, crowd[i].LOD, crowd[i].Mode);
+			poseOwner[i] = poses.Find(key, i);
+			sampleTime[i] = poses.Step > 0.0f ? poses.KeyTime(key) : crowd[i].Time;
+		}
+
 		mat4 projection = perspective(radians(camera.Zoom), (float)W / (float)H, 0.001f, 100.0f);
-		shader.setMat4("projection", projection);
-		
     	mat4 view = camera.GetViewMatrix();
-		shader.setMat4("view", view);
-		
-		mat4 model = mat4(1.0f);
-		model = scale(model, vec3(.5, .5, .5));
-		model = translate(model, vec3(0, 0, 0));
-		const quat& rot = angleAxis(radians(-90.f), vec3(1.f, 0.f, 0.f));/*rotation*/
-		model *= mat4_cast(rot);
-		shader.setMat4("model", model);
-		
-
-		mdl.BoneTransform(animationTime, Transforms, dualQuaternions);
-		
-		for(unsigned int i = 0; i < Transforms.size(); ++i)
+
+		// The variant for each influence count the skeletal LODs use. Holding
+		// O switches dual quaternion skinning to its DQ_OPTIMISED variants.
+		bool optimised = glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS;
+		const Shader* variants[MAX_BONES_PER_VERTEX + 1] = {};
+		for(unsigned int l = 0; l < max(mdl.NumLODs(), 1u); l++)
 		{
-			const string name = "gBones[" + to_string(i) + "]";
-			GLuint boneTransform = glGetUniformLocation(shader.ID, name.c_str());
-			shader.setMat4(name, Transforms[i]);
+			unsigned int numInfluences = mdl.NumInfluences(l);
+			if(variants[numInfluences])
+				continue;
+			const Shader& shader = shaders.get(SKINNING_VERTEX_SHADER, "./shaders/shader.fs",
+				SkinningPermutation(palettes.Mode, numInfluences, false, mdl.m_NumBones, optimised).Defines());
+			shader.use();
+			shader.setMat4("projection", projection);
+			shader.setMat4("view", view);
+			variants[numInfluences] = &shader;
 		}
-		DQs.resize(dualQuaternions.size());
-		
-		for (unsigned int i = 0; i < dualQuaternions.size(); ++i)
+
+		// One sample -> hierarchy -> palette -> draw chain per batch. Draws are
+		// pinned to this thread for GL and start as soon as their batch is
+		// posed, while the workers carry on with the later batches.
+		palettes.Resize(palettes.Mode, (unsigned int)crowd.size(), mdl.m_NumBones);
+		jobs.BeginFrame();
+		JobCounter frame;
+		unsigned int keysScanned = 0;
+		vector<Job*> paletteJobs;
+		for(unsigned int b = 0; b < crowd.size(); b += CROWD_BATCH)
 		{
-			DQs[i] = mat2x4_cast(dualQuaternions[i]);
-			const string name = "dqs[" + to_string(i) + "]";
-			shader.setMat2x4(name, DQs[i]);
+			unsigned int begin = b;
+			unsigned int end = min(b + CROWD_BATCH, (unsigned int)crowd.size());
+
+			Job* sample = jobs.Create("sample", [&, begin, end]
+			{
+				for(unsigned int i = begin; i < end; i++)
+					if(updating[i] && poseOwner[i] == i)
+						mdl.Sample(crowd[i], sampleTime[i]);
+			}, &frame);
+			Job* hierarchy = jobs.Create("hierarchy", [&, begin, end]
+			{
+				for(unsigned int i = begin; i < end; i++)
+					if(updating[i] && poseOwner[i] == i)
+						mdl.EvaluateHierarchy(crowd[i]);
+			}, &frame);
+			Job* palette = jobs.Create("palette", [&, begin, end]
+			{
+				for(unsigned int i = begin; i < end; i++)
+				{
+					if(!updating[i])
+						continue;
+					if(poseOwner[i] != i)
+					{
+						palettes.Copy(poseOwner[i], i);
+						crowd[i].MarkPosed();
+						continue;
+					}
+					mdl.BuildPalette(crowd[i]);
+					mdl.CopyPalette(crowd[i].Palette, palettes, palettes.Offset(i));
+				}
+			}, &frame);
+
+			// Cache hits copy palettes built by earlier batches.
+			unsigned int lastOwnerBatch = paletteJobs.size();
+			for(unsigned int i = begin; i < end; i++)
+			{
+				unsigned int ownerBatch = poseOwner[i] / CROWD_BATCH;
+				if(updating[i] && ownerBatch < paletteJobs.size() && ownerBatch != lastOwnerBatch)
+				{
+					jobs.DependsOn(palette, paletteJobs[ownerBatch]);
+					lastOwnerBatch = ownerBatch;
+				}
+			}
+			paletteJobs.push_back(palette);
+
+			Job* draw = jobs.Create("draw", [&, begin, end]
+			{
+				const Shader* current = nullptr;
+				for(unsigned int i = begin; i < end; i++)
+				{
+					if(baked[i])
+						continue;
+					// Lower skeletal LODs blend fewer influences.
+					const Shader& shader = *variants[mdl.NumInfluences(crowd[i].LOD)];
+					if(&shader != current)
+					{
+						shader.use();
+						current = &shader;
+					}
+					shader.setMat4("model", crowdModel(i));
+
+					unsigned int offset = palettes.Offset(i);
+					if(palettes.BonesPerInstance > 0)
+					{
+						if(palettes.Mode == SKINNING_LBS)
+							shader.setMat4Array("gBones", &palettes.Matrices[offset], palettes.BonesPerInstance);
+						else if(palettes.Mode == SKINNING_AFFINE)
+							shader.setMat3x4Array("gBones", &palettes.Affine[offset], palettes.BonesPerInstance);
+						else
+							shader.setMat2x4Array("dqs", &palettes.DualQuaternions[offset], palettes.BonesPerInstance);
+					}
+
+					mdl.Draw(shader, crowd[i].LOD);
+					if(updating[i] && poseOwner[i] == i)
+						keysScanned += crowd[i].Cursor.KeysScanned;
+				}
+			}, &frame, true);
+
+			jobs.DependsOn(hierarchy, sample);
+			jobs.DependsOn(palette, hierarchy);
+			jobs.DependsOn(draw, palette);
+			jobs.Submit(sample);
+			jobs.Submit(hierarchy);
+			jobs.Submit(palette);
+			jobs.Submit(draw);
+		}
+		jobs.Wait(frame);
+
+		unsigned int numBaked = 0;
+		const Shader& bakedShader = shaders.get(SKINNING_VERTEX_SHADER, "./shaders/shader.fs",
+			SkinningPermutation(bake.Mode, mdl.NumInfluences(0), true, 0, optimised).Defines());
+		bakedShader.use();
+		bakedShader.setMat4("projection", projection);
+		bakedShader.setMat4("view", view);
+		bake.Bind(bakedShader, 4);
+		for(unsigned int i = 0; i < crowd.size(); i++)
+		{
+			if(!baked[i])
+				continue;
+			bakedShader.setMat4("model", crowdModel(i));
+			bake.SetInstance(bakedShader, crowd[i].Clip, crowd[i].Time);
+			mdl.Draw(bakedShader);
+			numBaked++;
+		}
+
+		if(curFrame - lastStats >= 1.0f)
+		{
+			// The chain of jobs the frame waited on, with each job's duration.
+			string path;
+			vector<const Job*> critical = jobs.CriticalPath();
+			for(unsigned int i = 0; i < critical.size(); i++)
+				path += string(i > 0 ? " > " : "") + critical[i]->Name + " " + to_string((critical[i]->End - critical[i]->Start) * 1000.0);
+			double frameTime = critical.empty() ? 0.0 : jobs.FrameTime(critical.back()->End);
+
+			// Sampling cost per animated joint.
+			double sampling = 0.0;
+			for(unsigned int j = 0; j < jobs.NumJobs(); j++)
+				if(string(jobs.GetJob(j).Name) == "sample")
+					sampling += jobs.GetJob(j).End - jobs.GetJob(j).Start;
+			unsigned int sampledJoints = 0;
+			for(unsigned int i = 0; i < crowd.size(); i++)
+				if(updating[i] && poseOwner[i] == i)
+					sampledJoints += mdl.GetLOD(crowd[i]).AnimatedJoints.size();
+			double nsPerJoint = sampledJoints > 0 ? sampling * 1e9 / sampledJoints : 0.0;
+
+			const string title = to_string(numUpdating) + "/" + to_string(crowd.size()) + " characters updated, " + to_string(numBaked) + " baked, on " + to_string(jobs.NumThreads()) + " threads, frame: "
+				+ to_string(frameTime) + " ms (" + path + "), pose cache: " + to_string(poses.Hits) + " hits, " + to_string(poses.Misses) + " misses, keys scanned/frame: " + to_string(keysScanned)
+				+ ", sampling (" + SamplerISAName(mdl.m_SamplerISA) + "): " + to_string(nsPerJoint) + " ns/joint";
+			glfwSetWindowTitle(window, title.c_str());
+			lastStats = curFrame;
 		}
-		
-		if(glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS)
-			shader.setBool("optimised", GL_TRUE);
-		else
-			shader.setBool("optimised", GL_FALSE);
-				
-		mdl.Draw(shader);
 				        
         glfwSwapBuffers(window);
         glfwPollEvents();